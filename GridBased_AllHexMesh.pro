@@ -27,6 +27,9 @@ SOURCES += \
         main.cpp \
         mainwindow.cpp \
         twseventree.cpp \
+        linear_twseventree.cpp \
+        work_stealing_pool.cpp \
+        spatial_tree.cpp \
         drawable_twseventree.cpp \
         hex_transition_orient_3ref.cpp \
         hex_transition_install_3ref.cpp \
@@ -35,6 +38,9 @@ SOURCES += \
 HEADERS += \
         mainwindow.h \
         twseventree.h \
+        linear_twseventree.h \
+        work_stealing_pool.h \
+        spatial_tree.h \
         drawable_twseventree.h \
         hex_transition_schemes_3ref.h \
         hex_transition_orient_3ref.h \
@@ -93,7 +93,15 @@ void DrawableTwseventree::updateGL(const TwseventreeNode *node)
     if(node->is_inner)
     {
         assert(node->item_indices.empty());
-        for(int i=0; i<27; ++i) updateGL(node->children[i]);
+        for(int i=0; i<27; ++i)
+        {
+            if(node->children[i]!=nullptr) updateGL(node->children[i]);
+            else
+            {
+                AABB b = child_bbox(node, i); // implicit empty leaf
+                if(in_root_brick(b)) render_list.push_back(DrawableAABB(b.min, b.max));
+            }
+        }
     }
 }
 
@@ -0,0 +1,941 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+#include <linear_twseventree.h>
+#include <cinolib/how_many_seconds.h>
+#include <cinolib/parallel_for.h>
+#include <stack>
+#include <cstdio>
+#include <cstring>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cinolib
+{
+
+CINO_INLINE
+LinearTwseventree::LinearTwseventree(const Twseventree & tree, const bool adjacency)
+{
+    build(tree, adjacency);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+LinearTwseventree::~LinearTwseventree()
+{
+    clear();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::build(const Twseventree & tree, const bool adjacency)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    clear();
+    if(tree.root==nullptr) return;
+    bbox           = tree.root->bbox;
+    lattice_origin = tree.lattice_origin_point();
+    lattice_base   = tree.lattice_base_side();
+    lattice_levels = tree.lattice_base_depth()-1;
+
+    // depth first visit of the pointer based tree, assigning a code to each leaf.
+    // Empty children, which the pointer based tree does not allocate, become leaves
+    // with no items, so that the leaves always tile the whole root box (or root brick)
+    std::vector<std::pair<LinearTwseventreeLeaf,const TwseventreeNode*>> tmp;
+    tmp.reserve(tree.leaves.size() + tree.num_implicit_leaves());
+
+    // implicit leaves coarser than the base cells of an anchored tree are split into base cells
+    std::function<void(const LinearTwseventreeLeaf&,const AABB&)> implicit = [&](const LinearTwseventreeLeaf & cell, const AABB & cell_bbox)
+    {
+        if(!tree.in_root_brick(cell_bbox)) return;
+        if(cell.level+1 < tree.lattice_base_depth())
+        {
+            for(uint i=0; i<27; ++i)
+            {
+                LinearTwseventreeLeaf child;
+                child.code  = child_code(cell.code, cell.level, i);
+                child.level = cell.level + 1;
+                implicit(child, tree.child_bbox(cell_bbox, i));
+            }
+        }
+        else tmp.push_back(std::make_pair(cell, nullptr));
+    };
+
+    std::stack<std::pair<LinearTwseventreeLeaf,const TwseventreeNode*>> stack;
+    stack.push(std::make_pair(LinearTwseventreeLeaf(), tree.root));
+    while(!stack.empty())
+    {
+        auto pair = stack.top();
+        stack.pop();
+
+        if(pair.second->is_inner)
+        {
+            assert(pair.first.level < max_level && "27tree too deep to be linearized");
+            for(uint i=0; i<27; ++i)
+            {
+                LinearTwseventreeLeaf child;
+                child.code  = child_code(pair.first.code, pair.first.level, i);
+                child.level = pair.first.level + 1;
+                if(pair.second->children[i]!=nullptr) stack.push(std::make_pair(child, pair.second->children[i]));
+                else implicit(child, tree.child_bbox(pair.second, i));
+            }
+        }
+        else tmp.push_back(pair);
+    }
+
+    std::sort(tmp.begin(), tmp.end(), [](const std::pair<LinearTwseventreeLeaf,const TwseventreeNode*> & a,
+                                         const std::pair<LinearTwseventreeLeaf,const TwseventreeNode*> & b)
+    {
+        return a.first.code < b.first.code;
+    });
+
+    own_leaves.reserve(tmp.size());
+    own_offsets.reserve(tmp.size()+1);
+    own_offsets.push_back(0);
+    for(const auto & pair : tmp)
+    {
+        own_leaves.push_back(pair.first);
+        if(pair.second!=nullptr)
+        {
+            own_items.insert(own_items.end(), pair.second->item_indices.begin(), pair.second->item_indices.end());
+        }
+        own_offsets.push_back((uint)own_items.size());
+    }
+    bind_owned_arrays();
+    if(adjacency) build_adjacency();
+
+    if(print_debug_info)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+        std::cout << "Linear 27tree created (" << how_many_seconds(t0,t1) << "s)" << std::endl;
+        std::cout << "#Leaves                  : " << leaves.size()                     << std::endl;
+        std::cout << "Memory                   : " << num_bytes()/(1024.0*1024.0) << "MB" << std::endl;
+        std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::clear()
+{
+    bbox           = AABB();
+    lattice_origin = vec3d(0,0,0);
+    lattice_base   = 0;
+    lattice_levels = 0;
+    own_leaves.clear();
+    own_offsets.clear();
+    own_items.clear();
+    adj_offsets.clear();
+    adj.clear();
+    if(mapped!=nullptr)
+    {
+#ifndef _WIN32
+        munmap(mapped, mapped_bytes);
+#endif
+        mapped       = nullptr;
+        mapped_bytes = 0;
+    }
+    bind_owned_arrays();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::bind_owned_arrays()
+{
+    leaves.ptr         = own_leaves.data();
+    leaves.count       = own_leaves.size();
+    leaf_offsets.ptr   = own_offsets.data();
+    leaf_offsets.count = own_offsets.size();
+    leaf_items.ptr     = own_items.data();
+    leaf_items.count   = own_items.size();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool LinearTwseventree::save(const char *filename) const
+{
+    auto align = [](const uint64_t n) { return (n + 63) / 64 * 64; };
+
+    LinearTwseventreeFileHeader h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, "LIN27TR");
+    h.version    = file_version;
+    h.byte_order = 0x01020304;
+    h.max_level  = max_level;
+    h.leaf_bytes = sizeof(LinearTwseventreeLeaf);
+    for(int c=0; c<3; ++c)
+    {
+        h.bbox[c]    = bbox.min[c];
+        h.bbox[3+c]  = bbox.max[c];
+        h.lattice[c] = lattice_origin[c];
+    }
+    h.lattice[3]     = lattice_base;
+    h.lattice_levels = lattice_levels;
+    h.num_leaves = leaves.size();
+    h.num_items  = leaf_items.size();
+    h.leaves_at  = align(sizeof(h));
+    h.offsets_at = align(h.leaves_at  + h.num_leaves * sizeof(LinearTwseventreeLeaf));
+    h.items_at   = align(h.offsets_at + (h.num_leaves+1) * sizeof(uint));
+    h.file_bytes = h.items_at + h.num_items * sizeof(uint);
+
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+    {
+        std::cerr << "ERROR : " << __FILE__ << ", line " << __LINE__ << " : save() : couldn't open output file " << filename << std::endl;
+        return false;
+    }
+
+    // leaves are copied into value initialized blocks (pad = 0), so that equal trees give equal files
+    std::vector<LinearTwseventreeLeaf> block(std::min<size_t>(leaves.size(), 1<<16));
+    const char zeros[64] = {};
+    bool ok = fwrite(&h, sizeof(h), 1, f)==1;
+    ok = ok && fwrite(zeros, 1, h.leaves_at-sizeof(h), f)==h.leaves_at-sizeof(h);
+    for(size_t i=0; ok && i<leaves.size(); i+=block.size())
+    {
+        size_t n = std::min(block.size(), leaves.size()-i);
+        for(size_t j=0; j<n; ++j)
+        {
+            block[j].code  = leaves[i+j].code;
+            block[j].level = leaves[i+j].level;
+        }
+        ok = fwrite(block.data(), sizeof(LinearTwseventreeLeaf), n, f)==n;
+    }
+    uint64_t pos = h.leaves_at + h.num_leaves * sizeof(LinearTwseventreeLeaf);
+    ok = ok && fwrite(zeros, 1, h.offsets_at-pos, f)==h.offsets_at-pos;
+    if(leaf_offsets.empty())
+    {
+        uint zero = 0;
+        ok = ok && fwrite(&zero, sizeof(uint), 1, f)==1;
+    }
+    else ok = ok && fwrite(leaf_offsets.data(), sizeof(uint), leaf_offsets.size(), f)==leaf_offsets.size();
+    pos = h.offsets_at + (h.num_leaves+1) * sizeof(uint);
+    ok = ok && fwrite(zeros, 1, h.items_at-pos, f)==h.items_at-pos;
+    ok = ok && fwrite(leaf_items.data(), sizeof(uint), leaf_items.size(), f)==leaf_items.size();
+    ok = (fclose(f)==0) && ok;
+
+    if(!ok) std::cerr << "ERROR : " << __FILE__ << ", line " << __LINE__ << " : save() : couldn't write " << filename << std::endl;
+    return ok;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool LinearTwseventree::load(const char *filename)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    clear();
+    auto fail = [&](const char *msg)
+    {
+        std::cerr << "ERROR : " << __FILE__ << ", line " << __LINE__ << " : load() : " << msg << " " << filename << std::endl;
+        clear();
+        return false;
+    };
+
+    const char *data = nullptr;
+    size_t      size = 0;
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if(fd<0) return fail("couldn't open input file");
+    struct stat st;
+    if(fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(LinearTwseventreeFileHeader))
+    {
+        close(fd);
+        return fail("not a 27tree snapshot:");
+    }
+    size = (size_t)st.st_size;
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if(ptr==MAP_FAILED) return fail("couldn't map");
+    mapped       = ptr;
+    mapped_bytes = size;
+    data         = static_cast<const char*>(ptr);
+#else
+    // no mapping: the whole snapshot is read in a single owned block, and used in place as well
+    FILE *f = fopen(filename, "rb");
+    if(!f) return fail("couldn't open input file");
+    fseek(f, 0, SEEK_END);
+    size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(size<sizeof(LinearTwseventreeFileHeader))
+    {
+        fclose(f);
+        return fail("not a 27tree snapshot:");
+    }
+    own_items.resize((size+sizeof(uint)-1)/sizeof(uint));
+    bool read_ok = fread(own_items.data(), 1, size, f)==size;
+    fclose(f);
+    if(!read_ok) return fail("couldn't read");
+    data = reinterpret_cast<const char*>(own_items.data());
+#endif
+
+    LinearTwseventreeFileHeader h;
+    memcpy(&h, data, sizeof(h));
+    if(strncmp(h.magic, "LIN27TR", 8)!=0)          return fail("not a 27tree snapshot:");
+    if(h.version!=file_version)                    return fail("unsupported snapshot version in");
+    if(h.byte_order!=0x01020304 || h.max_level!=max_level ||
+       h.leaf_bytes!=sizeof(LinearTwseventreeLeaf)) return fail("snapshot written by an incompatible machine:");
+    if(h.file_bytes!=size || h.leaves_at%64!=0 || h.offsets_at%64!=0 || h.items_at%64!=0 ||
+       h.leaves_at  + h.num_leaves*sizeof(LinearTwseventreeLeaf) > h.offsets_at ||
+       h.offsets_at + (h.num_leaves+1)*sizeof(uint)              > h.items_at   ||
+       h.items_at   + h.num_items*sizeof(uint)                   > size)         return fail("corrupted snapshot:");
+
+    bbox = AABB(vec3d(h.bbox[0], h.bbox[1], h.bbox[2]), vec3d(h.bbox[3], h.bbox[4], h.bbox[5]));
+    lattice_origin = vec3d(h.lattice[0], h.lattice[1], h.lattice[2]);
+    lattice_base   = h.lattice[3];
+    lattice_levels = h.lattice_levels;
+    leaves.ptr         = reinterpret_cast<const LinearTwseventreeLeaf*>(data + h.leaves_at);
+    leaves.count       = h.num_leaves;
+    leaf_offsets.ptr   = reinterpret_cast<const uint*>(data + h.offsets_at);
+    leaf_offsets.count = h.num_leaves+1;
+    leaf_items.ptr     = reinterpret_cast<const uint*>(data + h.items_at);
+    leaf_items.count   = h.num_items;
+
+    // the file is untrusted input: queries index items by the offsets, derive extents from the
+    // levels and binary search the codes, so all of them are checked in a single pass
+    if(h.lattice_levels>max_level || leaf_offsets[0]!=0 || leaf_offsets[h.num_leaves]!=h.num_items) return fail("corrupted snapshot:");
+    uint64_t next = 0; // first code not covered by the leaves seen so far
+    for(size_t i=0; i<h.num_leaves; ++i)
+    {
+        const LinearTwseventreeLeaf & l = leaves[i];
+        if(l.level>max_level || leaf_offsets[i+1]<leaf_offsets[i] || leaf_offsets[i+1]>h.num_items) return fail("corrupted snapshot:");
+        uint64_t ext = code_extent(l.level);
+        if(l.code<next || l.code%ext!=0 || l.code>code_extent(0)-ext) return fail("corrupted snapshot:");
+        next = l.code + ext;
+    }
+
+    if(print_debug_info)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << "Linear 27tree " << (is_mapped() ? "mapped" : "loaded") << " from " << filename << " ("
+                  << how_many_seconds(t0,t1) << "s, " << leaves.size() << " leaves)" << std::endl;
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+AABB LinearTwseventree::leaf_bbox(const LinearTwseventreeLeaf & l) const
+{
+    // corners are computed as min + delta * (integer / 3^max_level), so that a corner shared
+    // by leaves at different levels always evaluates to the very same double
+    uint x, y, z;
+    decode(l.code, x, y, z);
+    double den = pow3(max_level);
+    double ext = pow3(max_level - l.level);
+    vec3d  d   = bbox.delta();
+    return AABB(vec3d(bbox.min[0] + d[0]*(x/den),       bbox.min[1] + d[1]*(y/den),       bbox.min[2] + d[2]*(z/den)),
+                vec3d(bbox.min[0] + d[0]*((x+ext)/den), bbox.min[1] + d[1]*((y+ext)/den), bbox.min[2] + d[2]*((z+ext)/den)));
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+int LinearTwseventree::find_leaf(const vec3d & p) const
+{
+    if(leaves.empty() || !bbox.contains(p)) return -1;
+
+    uint  n = pow3(max_level);
+    uint  g[3];
+    vec3d d = bbox.delta();
+    for(int i=0; i<3; ++i)
+    {
+        g[i] = (d[i]>0) ? (uint)std::min((double)(n-1), std::floor((p[i]-bbox.min[i])/d[i]*n)) : 0;
+    }
+    return search_leaf(encode(g[0], g[1], g[2]), -1);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+int LinearTwseventree::search_leaf(const uint64_t code, const int hint) const
+{
+    auto covers = [&](const size_t lid)
+    {
+        return code >= leaves[lid].code && code < leaves[lid].code + code_extent(leaves[lid].level);
+    };
+    if(hint>=0)
+    {
+        if(covers(hint))                                    return hint;
+        if((size_t)hint+1<leaves.size() && covers(hint+1)) return hint+1;
+    }
+
+    // the leaf containing the code is the last one whose code does not exceed it
+    auto it = std::upper_bound(leaves.begin(), leaves.end(), code, [](const uint64_t c, const LinearTwseventreeLeaf & l)
+    {
+        return c < l.code;
+    });
+    if(it==leaves.begin()) return -1;
+    --it;
+    if(code >= it->code + code_extent(it->level)) return -1; // a region not covered by leaves
+    return (int)(it - leaves.begin());
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint32_t LinearTwseventree::grid_coords(const double * x, const uint n, const double lo, const double hi, uint * g)
+{
+    // same arithmetic of find_leaf. Clamping to [0,n-1] comes before the conversion, which then
+    // truncates non negative values, hence floors them (SSE2 has no floor instruction)
+    assert(n<=32);
+    const double cells = pow3(max_level);
+    const double d     = hi - lo;
+    uint32_t     mask  = 0;
+    uint         i     = 0;
+
+#if defined(__AVX__)
+    const __m256d vlo = _mm256_set1_pd(lo), vhi = _mm256_set1_pd(hi), vd = _mm256_set1_pd(d);
+    const __m256d vn  = _mm256_set1_pd(cells), top = _mm256_set1_pd(cells-1), zero = _mm256_setzero_pd();
+    for(; d>0 && i+4<=n; i+=4)
+    {
+        __m256d v = _mm256_loadu_pd(x+i);
+        __m256d c = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(v, vlo), vd), vn);
+        c = _mm256_max_pd(zero, _mm256_min_pd(top, c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(g+i), _mm256_cvttpd_epi32(c));
+        mask |= (uint32_t)_mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(v, vlo, _CMP_GE_OQ), _mm256_cmp_pd(v, vhi, _CMP_LE_OQ))) << i;
+    }
+#elif defined(__SSE2__)
+    const __m128d vlo = _mm_set1_pd(lo), vhi = _mm_set1_pd(hi), vd = _mm_set1_pd(d);
+    const __m128d vn  = _mm_set1_pd(cells), top = _mm_set1_pd(cells-1), zero = _mm_setzero_pd();
+    for(; d>0 && i+2<=n; i+=2)
+    {
+        __m128d v = _mm_loadu_pd(x+i);
+        __m128d c = _mm_mul_pd(_mm_div_pd(_mm_sub_pd(v, vlo), vd), vn);
+        c = _mm_max_pd(zero, _mm_min_pd(top, c));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(g+i), _mm_cvttpd_epi32(c));
+        mask |= (uint32_t)_mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(v, vlo), _mm_cmple_pd(v, vhi))) << i;
+    }
+#endif
+
+    for(; i<n; ++i)
+    {
+        g[i] = (d>0) ? (uint)std::max(0.0, std::min(cells-1, std::floor((x[i]-lo)/d*cells))) : 0;
+        if(x[i]>=lo && x[i]<=hi) mask |= 1u<<i;
+    }
+    return mask;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::locate_leaves(const std::vector<vec3d> & p, std::vector<int> & leaf_ids) const
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    const uint lanes = 8;
+    const uint chunk = 4096; // points per parallel task (a multiple of lanes)
+    uint   np  = (uint)p.size();
+    leaf_ids.resize(np);
+    if(leaves.empty())
+    {
+        std::fill(leaf_ids.begin(), leaf_ids.end(), -1);
+        return;
+    }
+
+    vec3d  lo  = bbox.min;
+    vec3d  hi  = bbox.max;
+    uint   n_chunks = (np + chunk - 1) / chunk;
+    PARALLEL_FOR(0, n_chunks, 1, [&](uint c)
+    {
+        uint begin = c*chunk;
+        uint end   = std::min(np, begin+chunk);
+        int  hint  = -1;
+        for(uint i=begin; i<end; i+=lanes)
+        {
+            // lanes past the end are padded with the root corner
+            uint   m = std::min(lanes, end-i);
+            double x[3][lanes];
+            for(uint l=0; l<lanes; ++l)
+            for(int  k=0; k<3;     ++k) x[k][l] = (l<m) ? p[i+l][k] : lo[k];
+
+            uint     g[3][lanes];
+            uint32_t in = (1u<<lanes)-1;
+            for(int k=0; k<3; ++k) in &= grid_coords(x[k], lanes, lo[k], hi[k], g[k]);
+
+            for(uint l=0; l<m; ++l)
+            {
+                if(!(in & (1u<<l)))
+                {
+                    leaf_ids[i+l] = -1;
+                    continue;
+                }
+                uint64_t code = spread3(g[0][l]) + 3*spread3(g[1][l]) + 9*spread3(g[2][l]);
+                int      lid  = search_leaf(code, hint);
+                if(lid>=0) hint = lid;
+                leaf_ids[i+l] = lid;
+            }
+        }
+    });
+
+    if(print_debug_info)
+    {
+        std::cout << "Linear 27tree located " << np << " points (" << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::facing_leaves(const uint64_t code, const uint level, const int d[3], std::vector<uint> & out) const
+{
+    int lid = search_leaf(code, -1);
+    if(lid>=0 && leaves[lid].level<=level) // the cell is (part of) a leaf
+    {
+        out.push_back((uint)lid);
+        return;
+    }
+    if(lid<0) // the first code of the cell is not covered: does any leaf start inside the cell?
+    {
+        auto it = std::lower_bound(leaves.begin(), leaves.end(), code, [](const LinearTwseventreeLeaf & l, const uint64_t c)
+        {
+            return l.code < c;
+        });
+        if(it==leaves.end() || it->code >= code + code_extent(level)) return;
+    }
+    if(level==max_level) return;
+
+    // the cell is split: only the children on its side facing the leaf (-d) touch it
+    int lo[3], hi[3];
+    for(int c=0; c<3; ++c)
+    {
+        lo[c] = (d[c]<0) ? 2 : 0;
+        hi[c] = (d[c]>0) ? 0 : 2;
+    }
+    for(int k=lo[2]; k<=hi[2]; ++k)
+    for(int j=lo[1]; j<=hi[1]; ++j)
+    for(int i=lo[0]; i<=hi[0]; ++i)
+    {
+        facing_leaves(child_code(code, level, i + 3*j + 9*k), level+1, d, out);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::find_neighbors(const uint lid, std::vector<LinearTwseventreeNeighbor> & nbrs) const
+{
+    nbrs.clear();
+    const LinearTwseventreeLeaf & leaf = leaves.at(lid);
+
+    // candidates from all the directions. A neighbor met across more than one element (e.g. a face
+    // and some of its edges) keeps the largest one, that is the lowest kind
+    std::vector<uint> cells;
+    for(uint16_t kind=LinearTwseventreeNeighbor::FACE; kind<=LinearTwseventreeNeighbor::VERTEX; ++kind)
+    {
+        for(int dz=-1; dz<=1; ++dz)
+        for(int dy=-1; dy<=1; ++dy)
+        for(int dx=-1; dx<=1; ++dx)
+        {
+            if((dx!=0) + (dy!=0) + (dz!=0) != kind+1) continue;
+            uint64_t code;
+            if(!neighbor_code(leaf.code, leaf.level, dx, dy, dz, code)) continue;
+
+            int d[3] = { dx, dy, dz };
+            cells.clear();
+            facing_leaves(code, leaf.level, d, cells);
+            for(uint n : cells) nbrs.push_back({ n, (uint16_t)leaves[n].level, kind });
+        }
+    }
+    std::sort(nbrs.begin(), nbrs.end(), [](const LinearTwseventreeNeighbor & a, const LinearTwseventreeNeighbor & b)
+    {
+        return (a.lid<b.lid) || (a.lid==b.lid && a.kind<b.kind);
+    });
+    nbrs.erase(std::unique(nbrs.begin(), nbrs.end(), [](const LinearTwseventreeNeighbor & a, const LinearTwseventreeNeighbor & b)
+    {
+        return a.lid==b.lid;
+    }), nbrs.end());
+    std::sort(nbrs.begin(), nbrs.end(), [](const LinearTwseventreeNeighbor & a, const LinearTwseventreeNeighbor & b)
+    {
+        return (a.kind<b.kind) || (a.kind==b.kind && a.lid<b.lid);
+    });
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::build_adjacency()
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    // neighbors of each leaf in parallel, then packed in the CSR arrays
+    std::vector<std::vector<LinearTwseventreeNeighbor>> tmp(leaves.size());
+    PARALLEL_FOR(0, num_leaves(), 1000, [&](uint lid)
+    {
+        find_neighbors(lid, tmp[lid]);
+    });
+
+    adj_offsets.resize(leaves.size()+1);
+    adj_offsets[0] = 0;
+    for(size_t i=0; i<tmp.size(); ++i) adj_offsets[i+1] = adj_offsets[i] + (uint)tmp[i].size();
+    adj.resize(adj_offsets.back());
+    PARALLEL_FOR(0, num_leaves(), 1000, [&](uint lid)
+    {
+        std::copy(tmp[lid].begin(), tmp[lid].end(), adj.begin() + adj_offsets[lid]);
+    });
+
+    if(print_debug_info)
+    {
+        std::cout << "Linear 27tree adjacency: " << adj.size() << " neighbors (" << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+LinearTwseventreeDiff LinearTwseventree::diff(const LinearTwseventree & old_tree,
+                                              const LinearTwseventree & new_tree,
+                                              const bool                compare_items)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    LinearTwseventreeDiff d;
+    auto removed = [&](const uint lid)
+    {
+        d.removed.push_back({ lid, old_tree.leaves.at(lid).level, old_tree.leaf_bbox(lid) });
+    };
+    auto added = [&](const uint lid)
+    {
+        d.added.push_back({ lid, new_tree.leaves.at(lid).level, new_tree.leaf_bbox(lid) });
+    };
+    auto same = [&](const uint i, const uint j) -> bool
+    {
+        const LinearTwseventreeLeaf & a = old_tree.leaves[i];
+        const LinearTwseventreeLeaf & b = new_tree.leaves[j];
+        if(a.code!=b.code || a.level!=b.level) return false;
+        if(!compare_items) return true;
+        return old_tree.leaf_num_items(i)==new_tree.leaf_num_items(j) &&
+               std::equal(old_tree.leaf_items_begin(i), old_tree.leaf_items_end(i), new_tree.leaf_items_begin(j));
+    };
+
+    uint na = old_tree.num_leaves();
+    uint nb = new_tree.num_leaves();
+    bool same_root = old_tree.bbox.min==new_tree.bbox.min && old_tree.bbox.max==new_tree.bbox.max;
+    if(!same_root && old_tree.lattice_base>0 && old_tree.lattice_base==new_tree.lattice_base &&
+       old_tree.lattice_origin==new_tree.lattice_origin)
+    {
+        lattice_diff(old_tree, new_tree, compare_items, d);
+        na = nb = 0; // all leaves were classified
+    }
+    uint i = 0, j = 0;
+    while(same_root && i<na && j<nb)
+    {
+        const LinearTwseventreeLeaf & a = old_tree.leaves[i];
+        const LinearTwseventreeLeaf & b = new_tree.leaves[j];
+        if(same(i,j))
+        {
+            // identical stretches of both arrays (e.g. untouched subtrees) are consumed in one go
+            LinearTwseventreeDiff::Run run = { i, j, 0 };
+            while(i<na && j<nb && same(i,j)) { ++i; ++j; }
+            run.count = i - run.old_lid;
+            d.unchanged.push_back(run);
+            d.num_unchanged += run.count;
+        }
+        else if(a.code==b.code) // same corner, different level: the cell was split or merged
+        {
+            removed(i++);
+            added(j++);
+        }
+        else if(a.code<b.code) removed(i++);
+        else                   added(j++);
+    }
+    for(; i<na; ++i) removed(i);
+    for(; j<nb; ++j) added(j);
+
+    if(old_tree.print_debug_info)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << "Linear 27tree diff: " << d.added.size() << " added, " << d.removed.size() << " removed, "
+                  << d.num_unchanged << " unchanged leaves in " << d.unchanged.size() << " runs ("
+                  << how_many_seconds(t0,t1) << "s)" << std::endl;
+    }
+    return d;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::lattice_diff(const LinearTwseventree & old_tree,
+                                     const LinearTwseventree & new_tree,
+                                     const bool                compare_items,
+                                     LinearTwseventreeDiff   & d)
+{
+    // A leaf of an anchored tree lies in a single base cell, and below the base cells both trees
+    // split the same global lattice. The leaves of a base cell are a stretch of consecutive codes:
+    // the base cells of the old tree are visited in the order of its codes, and each one is re-based
+    // to a code of the new tree, whose stretch for the same cell follows the previous one or is found
+    // by binary search. The two stretches are merged on the codes within the cell, left aligned to the
+    // digits of the tree with fewer levels above the base cells (that has the most digits left below
+    // them). Removed leaves come out in the order of the old tree, and new leaves never matched are
+    // added in the order of the new tree, hence nothing is sorted
+    struct Frame
+    {
+        uint64_t base_ext; // codes spanned by a base cell
+        uint64_t align;    // scale of the codes within a base cell
+        uint     grid_ext; // grid coordinates spanned by a base cell
+        uint     cells;    // base cells per side of the root
+        int64_t  lo[3];    // lattice coordinates of the root
+        uint     levels;
+    };
+    uint min_levels = std::min(old_tree.lattice_levels, new_tree.lattice_levels);
+    auto frame = [&](const LinearTwseventree & t)
+    {
+        Frame f;
+        f.base_ext = code_extent(t.lattice_levels);
+        f.align    = code_extent(max_level - (t.lattice_levels - min_levels));
+        f.grid_ext = pow3(max_level - t.lattice_levels);
+        f.cells    = pow3(t.lattice_levels);
+        f.levels   = t.lattice_levels;
+        for(int c=0; c<3; ++c) f.lo[c] = std::llround((t.bbox.min[c] - t.lattice_origin[c]) / t.lattice_base);
+        return f;
+    };
+    const Frame fa = frame(old_tree);
+    const Frame fb = frame(new_tree);
+    const LinearTwseventreeArray<LinearTwseventreeLeaf> & la = old_tree.leaves;
+    const LinearTwseventreeArray<LinearTwseventreeLeaf> & lb = new_tree.leaves;
+
+    auto same = [&](const size_t i, const size_t j)
+    {
+        const LinearTwseventreeLeaf & a = la[i];
+        const LinearTwseventreeLeaf & b = lb[j];
+        assert(a.level>=fa.levels && b.level>=fb.levels && "leaf coarser than the lattice base cells");
+        if((a.code % fa.base_ext) * fa.align != (b.code % fb.base_ext) * fb.align || a.level-fa.levels != b.level-fb.levels) return false;
+        return !compare_items ||
+               (old_tree.leaf_num_items((uint)i)==new_tree.leaf_num_items((uint)j) &&
+                std::equal(old_tree.leaf_items_begin((uint)i), old_tree.leaf_items_end((uint)i), new_tree.leaf_items_begin((uint)j)));
+    };
+    auto removed = [&](const size_t lid) { d.removed.push_back({ (uint)lid, la[lid].level, old_tree.leaf_bbox((uint)lid) }); };
+
+    size_t na = la.size(), nb = lb.size();
+    std::vector<bool> matched(nb, false);
+    size_t i = 0, next = 0;
+    while(i<na)
+    {
+        uint64_t cell_a = la[i].code - la[i].code % fa.base_ext;
+        size_t   end_a  = i;
+        while(end_a<na && la[end_a].code<cell_a+fa.base_ext) ++end_a;
+
+        // stretch of the new tree in the same base cell (empty if its root does not cover the cell)
+        size_t j = 0, end_b = 0;
+        uint   g[3], gb[3];
+        bool   inside = true;
+        decode(cell_a, g[0], g[1], g[2]);
+        for(int c=0; c<3; ++c)
+        {
+            int64_t x = fa.lo[c] + g[c]/fa.grid_ext - fb.lo[c];
+            if(x<0 || x>=fb.cells) inside = false;
+            else gb[c] = uint(x)*fb.grid_ext;
+        }
+        if(inside)
+        {
+            uint64_t cell_b = encode(gb[0], gb[1], gb[2]);
+            if(next<nb && lb[next].code==cell_b) j = next;
+            else j = std::lower_bound(lb.begin(), lb.end(), cell_b, [](const LinearTwseventreeLeaf & l, const uint64_t c)
+                     {
+                         return l.code<c;
+                     }) - lb.begin();
+            end_b = j;
+            while(end_b<nb && lb[end_b].code<cell_b+fb.base_ext) ++end_b;
+            next = end_b;
+        }
+
+        while(i<end_a && j<end_b)
+        {
+            if(same(i,j))
+            {
+                // identical stretches are consumed in one go, and extend the last run if they
+                // follow it in both trees (e.g. consecutive base cells of an untouched region)
+                LinearTwseventreeDiff::Run run = { (uint)i, (uint)j, 0 };
+                while(i<end_a && j<end_b && same(i,j)) { matched[j] = true; ++i; ++j; }
+                run.count = (uint)i - run.old_lid;
+                d.num_unchanged += run.count;
+                LinearTwseventreeDiff::Run *r = d.unchanged.empty() ? nullptr : &d.unchanged.back();
+                if(r!=nullptr && r->old_lid+r->count==run.old_lid && r->new_lid+r->count==run.new_lid) r->count += run.count;
+                else d.unchanged.push_back(run);
+                continue;
+            }
+            uint64_t sa = (la[i].code % fa.base_ext) * fa.align;
+            uint64_t sb = (lb[j].code % fb.base_ext) * fb.align;
+            if(sa<=sb) removed(i++); // same corner, different level (or items): the cell was split or merged
+            if(sb<=sa) ++j;          // added below
+        }
+        for(; i<end_a; ++i) removed(i);
+    }
+    for(size_t j=0; j<nb; ++j)
+    {
+        if(!matched[j]) d.added.push_back({ (uint)j, lb[j].level, new_tree.leaf_bbox((uint)j) });
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+LinearTwseventreeDiff LinearTwseventree::diff(const Twseventree & old_tree,
+                                              const Twseventree & new_tree,
+                                              const bool          compare_items)
+{
+    // both trees are linearized first: the codes put their leaves in the same depth first order
+    return diff(LinearTwseventree(old_tree), LinearTwseventree(new_tree), compare_items);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint64_t LinearTwseventree::encode(const uint x, const uint y, const uint z)
+{
+    uint64_t code = 0;
+    for(uint l=1; l<=max_level; ++l)
+    {
+        uint p = pow3(max_level - l);
+        code = 27*code + (x/p)%3 + 3*((y/p)%3) + 9*((z/p)%3);
+    }
+    return code;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void LinearTwseventree::decode(const uint64_t code, uint & x, uint & y, uint & z)
+{
+    x = y = z = 0;
+    uint64_t c = code;
+    uint     p = 1;
+    for(uint l=0; l<max_level; ++l)
+    {
+        uint digit = c%27;
+        c /= 27;
+        x += p * (digit%3);
+        y += p * ((digit/3)%3);
+        z += p * (digit/9);
+        p *= 3;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint64_t LinearTwseventree::child_code(const uint64_t code, const uint level, const uint child)
+{
+    assert(level<max_level && child<27);
+    return code + child * code_extent(level+1);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint64_t LinearTwseventree::spread3(const uint x)
+{
+    // base 3 digits of the numbers below 3^7, spaced as base 27 digits. Coordinates have
+    // max_level = 13 digits: the 7 low ones and the 6 high ones take one lookup each
+    static const std::vector<uint64_t> table = []()
+    {
+        std::vector<uint64_t> t(2187);
+        for(uint v=0; v<t.size(); ++v)
+        {
+            uint64_t w = 1;
+            for(uint y=v; y>0; y/=3, w*=27) t[v] += (y%3) * w;
+        }
+        return t;
+    }();
+    assert(x < pow3(max_level));
+    return table[x%2187] + table[x/2187] * code_extent(max_level-7);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool LinearTwseventree::neighbor_code(const uint64_t code, const uint level, const int dx, const int dy, const int dz, uint64_t & n)
+{
+    // one cell of the same level along each axis, in grid coordinates at max_level
+    uint x, y, z;
+    decode(code, x, y, z);
+    int64_t e = pow3(max_level - level);
+    int64_t g[3] = { x + dx*e, y + dy*e, z + dz*e };
+    for(int c=0; c<3; ++c)
+    {
+        if(g[c]<0 || g[c]>=pow3(max_level)) return false;
+    }
+    n = spread3((uint)g[0]) + 3*spread3((uint)g[1]) + 9*spread3((uint)g[2]);
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint64_t LinearTwseventree::code_extent(const uint level)
+{
+    assert(level<=max_level);
+    uint64_t e = 1;
+    for(uint l=level; l<max_level; ++l) e *= 27;
+    return e;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint LinearTwseventree::pow3(const uint e)
+{
+    uint p = 1;
+    for(uint i=0; i<e; ++i) p *= 3;
+    return p;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+size_t LinearTwseventree::num_bytes() const
+{
+    return own_leaves.capacity()  * sizeof(LinearTwseventreeLeaf) +
+           own_offsets.capacity() * sizeof(uint) +
+           own_items.capacity()   * sizeof(uint) +
+           adj_offsets.capacity() * sizeof(uint) +
+           adj.capacity()         * sizeof(LinearTwseventreeNeighbor) + mapped_bytes;
+}
+
+}
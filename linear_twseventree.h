@@ -0,0 +1,275 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+
+#ifndef LINEAR_TWSEVENTREE_H
+#define LINEAR_TWSEVENTREE_H
+
+#include <twseventree.h>
+#include <cstdint>
+
+namespace cinolib
+{
+
+// A leaf of the linear 27tree. The code is a ternary Morton code: one base 27 digit
+// (i + 3j + 9k, the same child numbering used by TwseventreeNode::children) per level,
+// root digit first, left aligned to LinearTwseventree::max_level. Sorting leaves by
+// code sorts them in depth first order, and the bounding box of a leaf is derived
+// from (code,level) and the root box, hence it is not stored.
+struct LinearTwseventreeLeaf
+{
+    uint64_t code  = 0;
+    uint32_t level = 0; // 0 = root
+    uint32_t pad   = 0; // explicit padding, so that snapshots hold no uninitialized bytes
+};
+
+
+// Read only view on a contiguous array, which lives either in a std::vector owned by the
+// tree or in a memory mapped snapshot file
+template<class T>
+struct LinearTwseventreeArray
+{
+    const T *ptr   = nullptr;
+    size_t   count = 0;
+
+    const T * begin() const { return ptr;         }
+    const T * end()   const { return ptr + count; }
+    const T * data()  const { return ptr;         }
+    size_t    size()  const { return count;       }
+    bool      empty() const { return count==0;    }
+    const T & operator[](const size_t i) const { return ptr[i]; }
+    const T & at        (const size_t i) const { assert(i<count); return ptr[i]; }
+};
+
+// A leaf adjacent to another one, and the largest element they share (a face beats an edge,
+// which beats a vertex)
+struct LinearTwseventreeNeighbor
+{
+    enum Kind : uint16_t { FACE = 0, EDGE = 1, VERTEX = 2 };
+
+    uint32_t lid;
+    uint16_t level; // level of the neighbor, for size jumps
+    uint16_t kind;  // FACE if they share a 2D patch, EDGE if only a segment, VERTEX if only a point
+};
+
+// Header of a binary snapshot. The file is the header followed by the leaves, the leaf offsets and
+// the leaf items, each section starting at a multiple of 64 bytes, in the byte order of the machine
+// that wrote it. A mapped snapshot is used in place, without parsing or allocations
+struct LinearTwseventreeFileHeader
+{
+    char     magic[8];    // "LIN27TR"
+    uint32_t version;     // LinearTwseventree::file_version
+    uint32_t byte_order;  // 0x01020304 as written by the saving machine
+    uint32_t max_level;
+    uint32_t leaf_bytes;  // sizeof(LinearTwseventreeLeaf)
+    uint32_t lattice_levels;
+    uint32_t reserved;
+    double   bbox[6];     // root box (min, max)
+    double   lattice[4];  // lattice origin and base side (0: not anchored)
+    uint64_t num_leaves;
+    uint64_t num_items;
+    uint64_t leaves_at;   // byte offsets of the sections from the beginning of the file
+    uint64_t offsets_at;
+    uint64_t items_at;
+    uint64_t file_bytes;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+struct LinearTwseventreeDiff
+{
+    struct Leaf
+    {
+        uint     lid;   // index of the leaf in the tree it belongs to
+        uint32_t level;
+        AABB     bbox;
+    };
+    struct Run
+    {
+        uint old_lid; // first leaf of the run in the old tree
+        uint new_lid; // first leaf of the run in the new tree
+        uint count;
+    };
+
+    std::vector<Leaf> added;     // leaves of the new tree that are not in the old one
+    std::vector<Leaf> removed;   // leaves of the old tree that are not in the new one
+    std::vector<Run>  unchanged; // maximal runs of consecutive leaves present in both trees
+    size_t            num_unchanged = 0;
+};
+
+
+class LinearTwseventree
+{
+    public:
+        static const uint max_level    = 13; // 27^13 < 2^64
+        static const uint file_version = 2;
+
+        explicit LinearTwseventree() {}
+        explicit LinearTwseventree(const Twseventree & tree, const bool adjacency = false);
+                ~LinearTwseventree();
+
+        // arrays may live in a mapped file, which is released only once
+        LinearTwseventree(const LinearTwseventree &) = delete;
+        LinearTwseventree & operator=(const LinearTwseventree &) = delete;
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        void build(const Twseventree & tree, const bool adjacency = false); // adjacency: also build_adjacency()
+        void clear();
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // binary snapshot of the tree (see LinearTwseventreeFileHeader). load() maps the file in
+        // memory (reading it where mapping is not available) and the tree uses it in place: warm
+        // starts cost opening the file plus one linear pass that rejects corrupted snapshots (bad
+        // levels, unsorted or overlapping codes, item offsets out of range). Item lists index the
+        // items of the tree the snapshot was built from, which are not stored. Both return false on failure
+        bool save(const char *filename) const;
+        bool load(const char *filename);
+        bool is_mapped() const { return mapped!=nullptr; }
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        uint                          num_leaves() const { return (uint)leaves.size(); }
+        const LinearTwseventreeLeaf & leaf(const uint lid) const { return leaves.at(lid); }
+        const LinearTwseventreeLeaf * begin() const { return leaves.data(); }
+        const LinearTwseventreeLeaf * end()   const { return leaves.data() + leaves.size(); }
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // item lists index Twseventree::items (or Twseventree::triangles()) of the tree this was built from
+        const uint * leaf_items_begin(const uint lid) const { return leaf_items.data() + leaf_offsets.at(lid);   }
+        const uint * leaf_items_end  (const uint lid) const { return leaf_items.data() + leaf_offsets.at(lid+1); }
+        uint         leaf_num_items  (const uint lid) const { return leaf_offsets.at(lid+1) - leaf_offsets.at(lid); }
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        AABB leaf_bbox(const uint lid) const { return leaf_bbox(leaves.at(lid)); }
+        AABB leaf_bbox(const LinearTwseventreeLeaf & l) const;
+        int  find_leaf(const vec3d & p) const; // -1 if p is outside the root box
+
+        // find_leaf for many points, in parallel over chunks. Grid coordinates are computed for 8
+        // points at a time with SIMD instructions (grid_coords), codes come from a table of base 3
+        // digits, and each search starts from the leaf of the previous point, which is a hit for
+        // coherent inputs (grid vertices, samples along a path). leaf_ids[i] = find_leaf(p[i])
+        void locate_leaves(const std::vector<vec3d> & p, std::vector<int> & leaf_ids) const;
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // neighbors of a leaf, from ternary codes: for each of the 26 directions the cell of the same
+        // level next to the leaf is located (neighbor_code), and if it lies inside a finer region only
+        // the sub cells facing the leaf are visited. Each neighbor appears once, with the kind of the
+        // largest element it shares (a leaf coarser than lid can share a face and an edge), sorted by
+        // kind and lid. Cells outside the root box or dropped out of the root brick have no leaves
+        void find_neighbors(const uint lid, std::vector<LinearTwseventreeNeighbor> & nbrs) const;
+
+        // table of the neighbors of all the leaves (CSR), computed in parallel. Optional, as it costs
+        // about 10x the memory of the leaves; snapshots do not store it
+        void build_adjacency();
+        bool has_adjacency() const { return !adj_offsets.empty(); }
+        const LinearTwseventreeNeighbor * neighbors_begin(const uint lid) const { return adj.data() + adj_offsets.at(lid);   }
+        const LinearTwseventreeNeighbor * neighbors_end  (const uint lid) const { return adj.data() + adj_offsets.at(lid+1); }
+        uint                              num_neighbors  (const uint lid) const { return adj_offsets.at(lid+1) - adj_offsets.at(lid); }
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // leaves added, removed and unchanged between two trees, in a single linear merge of the
+        // two sorted leaf arrays. A leaf is unchanged if the other tree has a leaf with the same
+        // code and level (and, if compare_items is true, the same item list). Identical stretches
+        // are skipped as runs, and are not expanded leaf by leaf. Trees anchored to the same lattice
+        // (Twseventree::set_lattice) share their base cells even if their roots differ (a part that
+        // moved or grew): the base cells of the old tree are then located in the new one by their
+        // lattice coordinates, and their leaves merged cell by cell, still without sorting. Runs are
+        // the stretches consecutive in both trees. Other trees with different root boxes share no
+        // cell: all the old leaves are removed and all the new ones added. The overload for pointer
+        // based trees linearizes them, and leaf ids refer to LinearTwseventree(old/new_tree)
+        static LinearTwseventreeDiff diff(const LinearTwseventree & old_tree,
+                                          const LinearTwseventree & new_tree,
+                                          const bool                compare_items = false);
+        static LinearTwseventreeDiff diff(const Twseventree       & old_tree,
+                                          const Twseventree       & new_tree,
+                                          const bool                compare_items = false);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        static uint64_t encode     (const uint x, const uint y, const uint z); // grid coordinates at max_level
+        static void     decode     (const uint64_t code, uint & x, uint & y, uint & z);
+        static uint64_t child_code (const uint64_t code, const uint level, const uint child);
+        static uint64_t code_extent(const uint level); // number of max_level codes spanned by a cell at level
+        static bool     neighbor_code(const uint64_t code, const uint level, const int dx, const int dy, const int dz, uint64_t & n); // false outside the root
+        static uint     pow3       (const uint e);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        size_t num_bytes() const;
+
+        AABB bbox; // root box
+
+        // lattice of an anchored tree (see Twseventree::set_lattice), lattice_base = 0 if not anchored.
+        // Leaves are then base cells or finer, and the root spans 3^lattice_levels base cells
+        vec3d  lattice_origin = vec3d(0,0,0);
+        double lattice_base   = 0;
+        uint   lattice_levels = 0;
+
+    protected:
+
+        LinearTwseventreeArray<LinearTwseventreeLeaf> leaves;       // sorted by code
+        LinearTwseventreeArray<uint>                  leaf_offsets; // CSR: items of leaf i are leaf_items[leaf_offsets[i] .. leaf_offsets[i+1]]
+        LinearTwseventreeArray<uint>                  leaf_items;
+        bool print_debug_info = true;
+
+        // storage of the arrays above: either owned vectors or a mapped snapshot
+        std::vector<LinearTwseventreeLeaf> own_leaves;
+        std::vector<uint>                  own_offsets;
+        std::vector<uint>                  own_items;
+        void                              *mapped       = nullptr;
+        size_t                             mapped_bytes = 0;
+
+        void bind_owned_arrays();
+        static void lattice_diff(const LinearTwseventree & old_tree, const LinearTwseventree & new_tree, const bool compare_items, LinearTwseventreeDiff & d);
+        int  search_leaf(const uint64_t code, const int hint) const; // leaf containing a max_level code (hint: a likely leaf, or -1)
+        void facing_leaves(const uint64_t code, const uint level, const int d[3], std::vector<uint> & out) const; // leaves of the cell touching its side -d
+
+        std::vector<uint>                      adj_offsets; // CSR: neighbors of leaf i are adj[adj_offsets[i] .. adj_offsets[i+1]]
+        std::vector<LinearTwseventreeNeighbor> adj;
+        static uint64_t spread3(const uint x); // encode(x,0,0), by table lookup
+
+        // grid coordinates at max_level of n coordinates x[i] along an axis spanned by the root box from
+        // lo to hi, several at once, one per SIMD lane: g[i] is the one of find_leaf, clamped to the grid
+        // so that coordinates outside convert safely. Returns the mask of the x[i] in [lo,hi] (n <= 32)
+        static uint32_t grid_coords(const double *x, const uint n, const double lo, const double hi, uint *g);
+};
+
+}
+
+#ifndef  CINO_STATIC_LIB
+#include "linear_twseventree.cpp"
+#endif
+
+#endif // LINEAR_TWSEVENTREE_H
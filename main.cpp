@@ -20,6 +20,7 @@
 #include <numeric>
 #include <cinolib/export_surface.h>
 #include <drawable_twseventree.h>
+#include <linear_twseventree.h>
 
 namespace cinolib
 {
@@ -244,28 +245,12 @@ void split27(const uint                                   pid,
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 template<class M, class V, class E, class F, class P>
-void export_hexmesh(const Twseventree                                & grid,
+void export_hexmesh(const std::vector<vec3d>                         & verts,
+                    const std::vector<std::vector<uint>>             & polys,
                           Hexmesh<M,V,E,F,P>                         & output,
                           std::map<vec3d, uint, vert_compare>        & v_map,
                           std::vector<VertInfo>                      & transition_verts){
 
-    std::vector<uint>               poly;
-    std::vector<std::vector<uint>>  polys;
-    std::vector<vec3d>              verts;
-
-
-    uint conta_vert=0;
-    for (auto el: grid.leaves){
-        for(auto & vert : el->bbox.corners()){
-            verts.push_back(vert);
-            poly.push_back(conta_vert);
-            conta_vert++;
-        }
-        polys.push_back(poly);
-        poly.clear();
-    }
-
-
     //merge vertices
     for (auto & v : verts){
         if (v_map.find(v) == v_map.end()){
@@ -292,6 +277,59 @@ void export_hexmesh(const Twseventree                                & grid,
 
 }
 
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+template<class M, class V, class E, class F, class P>
+void export_hexmesh(const Twseventree                                & grid,
+                          Hexmesh<M,V,E,F,P>                         & output,
+                          std::map<vec3d, uint, vert_compare>        & v_map,
+                          std::vector<VertInfo>                      & transition_verts){
+
+    std::vector<uint>               poly;
+    std::vector<std::vector<uint>>  polys;
+    std::vector<vec3d>              verts;
+
+
+    // empty leaves are implicit in the tree, and are materialized here
+    uint conta_vert=0;
+    grid.for_each_leaf([&](const AABB & bbox, const TwseventreeNode *, const uint){
+        for(auto & vert : bbox.corners()){
+            verts.push_back(vert);
+            poly.push_back(conta_vert);
+            conta_vert++;
+        }
+        polys.push_back(poly);
+        poly.clear();
+    });
+
+    export_hexmesh(verts, polys, output, v_map, transition_verts);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+template<class M, class V, class E, class F, class P>
+void export_hexmesh(const LinearTwseventree                          & grid,
+                          Hexmesh<M,V,E,F,P>                         & output,
+                          std::map<vec3d, uint, vert_compare>        & v_map,
+                          std::vector<VertInfo>                      & transition_verts){
+
+    std::vector<uint>               poly;
+    std::vector<std::vector<uint>>  polys;
+    std::vector<vec3d>              verts;
+
+
+    uint conta_vert=0;
+    for (auto & el: grid){
+        for(auto & vert : grid.leaf_bbox(el).corners()){
+            verts.push_back(vert);
+            poly.push_back(conta_vert);
+            conta_vert++;
+        }
+        polys.push_back(poly);
+        poly.clear();
+    }
+
+    export_hexmesh(verts, polys, output, v_map, transition_verts);
+}
+
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 template<class M, class V, class E, class F, class P>
 void balancing_gridmesh(Hexmesh<M,V,E,F,P>                         & mesh,
@@ -0,0 +1,192 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+#include <spatial_tree.h>
+#include <cinolib/how_many_seconds.h>
+#include <numeric>
+
+namespace cinolib
+{
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+SpatialTree<Arity,ItemT,Real>::SpatialTree(const uint max_depth,
+                                           const uint items_per_leaf)
+: max_depth(max_depth)
+, items_per_leaf(items_per_leaf)
+{}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+void SpatialTree<Arity,ItemT,Real>::build()
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    nodes.clear();
+    item_ids.clear();
+    tree_depth   = 0;
+    leaves_count = 0;
+    if(items.empty()) return;
+
+    AABB bbox;
+    for(const ItemT & it : items) bbox.push(it.aabb);
+
+    Node root;
+    for(int c=0; c<3; ++c)
+    {
+        root.min[c] = Real(bbox.min[c]);
+        root.max[c] = Real(bbox.max[c]);
+    }
+    nodes.push_back(root);
+
+    std::vector<uint> all(items.size());
+    std::iota(all.begin(), all.end(), 0);
+    item_ids.reserve(items.size());
+    split(0, all, 1);
+
+    if(print_debug_info)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+        std::cout << "SpatialTree<" << Arity << "> created (" << how_many_seconds(t0,t1) << "s)" << std::endl;
+        std::cout << "#Items                   : " << items.size() << std::endl;
+        std::cout << "#Leaves                  : " << leaves_count << std::endl;
+        std::cout << "#Nodes                   : " << nodes.size() << std::endl;
+        std::cout << "Max depth                : " << max_depth    << std::endl;
+        std::cout << "Depth                    : " << tree_depth   << std::endl;
+        std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+void SpatialTree<Arity,ItemT,Real>::split(const uint nid, std::vector<uint> & node_items, const uint depth)
+{
+    tree_depth = std::max(tree_depth, depth);
+
+    if(depth>=max_depth || node_items.size()<=items_per_leaf)
+    {
+        nodes.at(nid).item_begin = (uint)item_ids.size();
+        nodes.at(nid).item_count = (uint)node_items.size();
+        item_ids.insert(item_ids.end(), node_items.begin(), node_items.end());
+        ++leaves_count;
+        return;
+    }
+
+    // note: nodes may be reallocated below, hence nodes are always accessed by index
+    Real planes[3][Arity+1];
+    Layout::split_planes(nodes.at(nid).min, nodes.at(nid).max, planes);
+
+    uint first = (uint)nodes.size();
+    nodes.resize(first + Layout::children);
+    nodes.at(nid).first_child = first;
+    for(uint c=0; c<Layout::children; ++c)
+    {
+        Layout::child_bbox(planes, c, nodes.at(first+c).min, nodes.at(first+c).max);
+    }
+
+    std::vector<uint> lists[Layout::children];
+    for(uint it : node_items)
+    {
+        const AABB & b = items.at(it).aabb;
+        Real min[3] = { Real(b.min[0]), Real(b.min[1]), Real(b.min[2]) };
+        Real max[3] = { Real(b.max[0]), Real(b.max[1]), Real(b.max[2]) };
+        Mask mask   = Layout::child_mask(planes, min, max);
+        for(uint c=0; c<Layout::children; ++c)
+        {
+            if((mask>>c) & 1) lists[c].push_back(it);
+        }
+    }
+    std::vector<uint>().swap(node_items);
+
+    for(uint c=0; c<Layout::children; ++c) split(first+c, lists[c], depth+1);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+int SpatialTree<Arity,ItemT,Real>::locate(const vec3d & p) const
+{
+    if(nodes.empty()) return -1;
+    for(int c=0; c<3; ++c)
+    {
+        if(p[c] < nodes.front().min[c] || p[c] > nodes.front().max[c]) return -1;
+    }
+
+    uint nid = 0;
+    while(nodes.at(nid).first_child!=0)
+    {
+        Real planes[3][Arity+1];
+        Layout::split_planes(nodes.at(nid).min, nodes.at(nid).max, planes);
+        uint i = Layout::slab(planes[0], Real(p[0]));
+        uint j = Layout::slab(planes[1], Real(p[1]));
+        uint k = Layout::slab(planes[2], Real(p[2]));
+        nid = nodes.at(nid).first_child + Layout::child_index(i,j,k);
+    }
+    return (int)nid;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+bool SpatialTree<Arity,ItemT,Real>::contains(const vec3d & p, const bool strict, std::unordered_set<uint> & ids) const
+{
+    // an item whose (closed) AABB contains p is listed in every leaf whose box contains p,
+    // hence visiting the single leaf returned by locate() is enough
+    ids.clear();
+    int nid = locate(p);
+    if(nid<0) return false;
+
+    const Node & n = nodes.at(nid);
+    for(uint i=n.item_begin; i<n.item_begin+n.item_count; ++i)
+    {
+        const ItemT & it = items.at(item_ids.at(i));
+        if(it.contains(p,strict)) ids.insert(it.id);
+    }
+    return !ids.empty();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity, class ItemT, class Real>
+CINO_INLINE
+AABB SpatialTree<Arity,ItemT,Real>::node_bbox(const uint nid) const
+{
+    const Node & n = nodes.at(nid);
+    return AABB(vec3d(n.min[0], n.min[1], n.min[2]), vec3d(n.max[0], n.max[1], n.max[2]));
+}
+
+}
@@ -0,0 +1,219 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+
+#ifndef SPATIAL_TREE_H
+#define SPATIAL_TREE_H
+
+#include <cinolib/geometry/spatial_data_structure_item.h>
+#include <cstdint>
+#include <type_traits>
+#include <unordered_set>
+
+namespace cinolib
+{
+
+// Compile time description of a regular tree where each node is split in Arity slabs
+// along each axis (Arity=2: octree, Arity=3: 27tree). Child numbering is i + Arity*(j + Arity*k),
+// which for Arity=3 is the numbering used by TwseventreeNode::children. All loops have
+// compile time bounds, so the compiler can fully unroll them
+template<uint Arity>
+struct SpatialTreeLayout
+{
+    static_assert(Arity>=2 && Arity*Arity*Arity<=64, "unsupported arity");
+
+    static constexpr uint per_axis = Arity;
+    static constexpr uint children = Arity*Arity*Arity;
+
+    typedef typename std::conditional<(children<=32), uint32_t, uint64_t>::type Mask; // one bit per child
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    static constexpr uint child_index(const uint i, const uint j, const uint k)
+    {
+        return i + Arity*(j + Arity*k);
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    // planes[0]=lo, planes[Arity]=hi. Planes in the first half are offsets from lo, planes
+    // in the second half are offsets from hi, so that the split is symmetric in floating point
+    template<class Real>
+    static void split_planes(const Real lo, const Real hi, Real planes[Arity+1])
+    {
+        Real d = hi - lo;
+        planes[0]     = lo;
+        planes[Arity] = hi;
+        for(uint p=1; p<Arity; ++p)
+        {
+            planes[p] = (2*p<=Arity) ? lo + d*Real(p)/Real(Arity)
+                                     : hi - d*Real(Arity-p)/Real(Arity);
+        }
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    template<class Real>
+    static void split_planes(const Real min[3], const Real max[3], Real planes[3][Arity+1])
+    {
+        for(int c=0; c<3; ++c) split_planes(min[c], max[c], planes[c]);
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    template<class Real>
+    static void child_bbox(const Real planes[3][Arity+1], const uint child, Real min[3], Real max[3])
+    {
+        uint idx[3] = { child%Arity, (child/Arity)%Arity, child/(Arity*Arity) };
+        for(int c=0; c<3; ++c)
+        {
+            min[c] = planes[c][idx[c]];
+            max[c] = planes[c][idx[c]+1];
+        }
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    // slab containing x (the last one if x sits on a split plane)
+    template<class Real>
+    static uint slab(const Real planes[Arity+1], const Real x)
+    {
+        uint s = 0;
+        for(uint p=1; p<Arity; ++p) s += (x >= planes[p]);
+        return s;
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    // range first..last of the (closed) slabs overlapped by [lo,hi], assuming [lo,hi] overlaps the node
+    template<class Real>
+    static void slab_range(const Real planes[Arity+1], const Real lo, const Real hi, uint & first, uint & last)
+    {
+        first = last = 0;
+        for(uint p=1; p<Arity; ++p)
+        {
+            first += (lo >  planes[p]);
+            last  += (hi >= planes[p]);
+        }
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    // mask of the children in the box of slab ranges first[c]..last[c]
+    static Mask range_mask(const uint first[3], const uint last[3])
+    {
+        Mask row = ((Mask(1) << (last[0]+1)) - 1) & ~((Mask(1) << first[0]) - 1);
+        Mask layer = 0;
+        for(uint j=first[1]; j<=last[1]; ++j) layer |= row << (Arity*j);
+        Mask mask = 0;
+        for(uint k=first[2]; k<=last[2]; ++k) mask |= layer << (Arity*Arity*k);
+        return mask;
+    }
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    template<class Real>
+    static Mask child_mask(const Real planes[3][Arity+1], const Real min[3], const Real max[3])
+    {
+        uint first[3], last[3];
+        for(int c=0; c<3; ++c) slab_range(planes[c], min[c], max[c], first[c], last[c]);
+        return range_mask(first, last);
+    }
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// Generic regular spatial tree, specialized at compile time on the number of slabs per axis,
+// on the item type (stored by value, hence accessed without virtual dispatch through pointers)
+// and on the scalar type used for node boxes. ItemT must expose an AABB aabb, a uint id and
+// contains(const vec3d &, const bool strict) (e.g. cinolib::Triangle).
+// Nodes live in one flat array, and the children of a node are contiguous in it.
+// tests/bench_spatial_tree.cpp times it against cinolib::Octree (Arity=2) and Twseventree (Arity=3)
+template<uint Arity, class ItemT, class Real = double>
+class SpatialTree
+{
+    public:
+
+        typedef SpatialTreeLayout<Arity>  Layout;
+        typedef typename Layout::Mask     Mask;
+
+        struct Node
+        {
+            Real min[3];
+            Real max[3];
+            uint first_child = 0; // 0 = leaf (the root is never a child)
+            uint item_begin  = 0; // leaf items are item_ids[item_begin .. item_begin+item_count]
+            uint item_count  = 0;
+        };
+
+        explicit SpatialTree(const uint max_depth      = 6,
+                             const uint items_per_leaf = 100);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        void push (const ItemT & item) { items.push_back(item); }
+        void build();
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // ids of the items containing p (same semantics of cinolib::Octree::contains)
+        bool contains(const vec3d & p, const bool strict, std::unordered_set<uint> & ids) const;
+        int  locate  (const vec3d & p) const; // leaf node containing p, -1 if outside
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        uint               num_nodes () const { return (uint)nodes.size(); }
+        uint               num_leaves() const { return leaves_count;       }
+        uint               depth     () const { return tree_depth;         }
+        const Node       & node(const uint nid) const { return nodes.at(nid); }
+        AABB               node_bbox(const uint nid) const;
+
+        std::vector<ItemT> items;
+
+    protected:
+
+        void split(const uint nid, std::vector<uint> & node_items, const uint depth);
+
+        uint max_depth;
+        uint items_per_leaf;
+        uint tree_depth   = 0;
+        uint leaves_count = 0;
+        bool print_debug_info = true;
+
+        std::vector<Node> nodes;
+        std::vector<uint> item_ids;
+};
+
+}
+
+#ifndef  CINO_STATIC_LIB
+#include "spatial_tree.cpp"
+#endif
+
+#endif // SPATIAL_TREE_H
@@ -0,0 +1,219 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+
+// Build and query timings of the SpatialTree template against the classes it could replace:
+// cinolib::Octree vs SpatialTree<2>, and Twseventree vs SpatialTree<3>. The query is the one of
+// balancing_gridmesh (ids of the triangles containing a point), on two workloads: the quad faces
+// of a grid of cubes queried at its vertices, and a sphere queried at random points of its box.
+// The same total of ids must come out of all the trees of a workload
+
+#include <twseventree.h>
+#include <spatial_tree.h>
+#include <cinolib/octree.h>
+#include <cinolib/geometry/triangle.h>
+#include <cinolib/how_many_seconds.h>
+#include <cmath>
+#include <random>
+
+using namespace cinolib;
+
+typedef std::chrono::high_resolution_clock Time;
+
+struct Workload
+{
+    const char                      *name;
+    std::vector<std::array<vec3d,3>> tris;
+    std::vector<uint>                ids;     // the id of each triangle (its quad, for grids)
+    std::vector<vec3d>               queries;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// faces of an n x n x n grid of unit cubes, each quad split in two triangles, queried at the grid vertices
+Workload grid_faces(const uint n)
+{
+    Workload w;
+    w.name = "grid faces";
+    uint fid = 0;
+    for(int a=0; a<3; ++a)
+    for(uint i=0; i<=n; ++i)
+    for(uint j=0; j<n;  ++j)
+    for(uint k=0; k<n;  ++k, ++fid)
+    {
+        auto v = [&](const uint dj, const uint dk)
+        {
+            vec3d p;
+            p[a]       = i;
+            p[(a+1)%3] = j+dj;
+            p[(a+2)%3] = k+dk;
+            return p;
+        };
+        w.tris.push_back({ v(0,0), v(1,0), v(1,1) });
+        w.tris.push_back({ v(0,0), v(1,1), v(0,1) });
+        w.ids.insert(w.ids.end(), { fid, fid });
+    }
+    for(uint i=0; i<=n; ++i)
+    for(uint j=0; j<=n; ++j)
+    for(uint k=0; k<=n; ++k) w.queries.push_back(vec3d(i,j,k));
+    return w;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// UV sphere queried at random points of its box, half of which are moved onto the surface
+Workload sphere(const uint nu, const uint nv, const uint nq)
+{
+    Workload w;
+    w.name = "sphere";
+    auto v = [&](const uint i, const uint j)
+    {
+        double th = M_PI*j/nv, ph = 2*M_PI*(i%nu)/nu;
+        return vec3d(std::sin(th)*std::cos(ph), std::sin(th)*std::sin(ph), std::cos(th));
+    };
+    for(uint j=0; j<nv; ++j)
+    for(uint i=0; i<nu; ++i)
+    {
+        // the triangles of the poles with two coincident vertices are skipped
+        if(j>0)    w.tris.push_back({ v(i,j), v(i+1,j), v(i+1,j+1) });
+        if(j<nv-1) w.tris.push_back({ v(i,j), v(i+1,j+1), v(i,j+1) });
+    }
+    for(uint i=0; i<w.tris.size(); ++i) w.ids.push_back(i);
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> u(-1,1);
+    std::uniform_int_distribution<size_t>  t(0, w.tris.size()-1);
+    for(uint q=0; q<nq; ++q)
+    {
+        if(q%2==0) w.queries.push_back(vec3d(u(rng), u(rng), u(rng)));
+        else
+        {
+            const std::array<vec3d,3> & tri = w.tris.at(t(rng));
+            w.queries.push_back((tri[0] + tri[1] + tri[2])/3.0);
+        }
+    }
+    return w;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+void report(const char *tree, const double t_build, const double t_query, const size_t found)
+{
+    printf("  %-16s build %8.4fs   queries %8.4fs   ids found %zu\n", tree, t_build, t_query, found);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+template<uint Arity>
+void bench_spatial_tree(const Workload & w, const uint max_depth, const uint items_per_leaf)
+{
+    Time::time_point t0 = Time::now();
+    SpatialTree<Arity,Triangle> tree(max_depth, items_per_leaf);
+    tree.items.reserve(w.tris.size());
+    for(size_t i=0; i<w.tris.size(); ++i) tree.push(Triangle(w.ids.at(i), w.tris.at(i).data()));
+    tree.build();
+    Time::time_point t1 = Time::now();
+    size_t found = 0;
+    std::unordered_set<uint> ids;
+    for(const vec3d & p : w.queries)
+    {
+        tree.contains(p, false, ids);
+        found += ids.size();
+    }
+    report(Arity==2 ? "SpatialTree<2>" : "SpatialTree<3>", how_many_seconds(t0,t1), how_many_seconds(t1,Time::now()), found);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+void bench_octree(const Workload & w, const uint max_depth, const uint items_per_leaf)
+{
+    Time::time_point t0 = Time::now();
+    Octree tree(max_depth, items_per_leaf);
+    for(size_t i=0; i<w.tris.size(); ++i)
+    {
+        tree.push_triangle(w.ids.at(i), { w.tris.at(i)[0], w.tris.at(i)[1], w.tris.at(i)[2] });
+    }
+    tree.build();
+    Time::time_point t1 = Time::now();
+    size_t found = 0;
+    std::unordered_set<uint> ids;
+    for(const vec3d & p : w.queries)
+    {
+        tree.contains(p, false, ids);
+        found += ids.size();
+    }
+    report("Octree", how_many_seconds(t0,t1), how_many_seconds(t1,Time::now()), found);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+void bench_twseventree(const Workload & w, const uint max_depth, const uint items_per_leaf)
+{
+    Time::time_point t0 = Time::now();
+    Twseventree tree(max_depth, items_per_leaf);
+    for(size_t i=0; i<w.tris.size(); ++i)
+    {
+        tree.push_triangle(w.ids.at(i), w.tris.at(i)[0], w.tris.at(i)[1], w.tris.at(i)[2]);
+    }
+    tree.build();
+    Time::time_point t1 = Time::now();
+
+    // Twseventree has no contains(): the leaves of the point are visited, and their items tested
+    size_t found = 0;
+    std::unordered_set<uint> ids;
+    TwseventreeQueryContext  ctx;
+    for(const vec3d & p : w.queries)
+    {
+        ids.clear();
+        tree.query_leaves(AABB(p,p), ctx);
+        for(const TwseventreeNode *leaf : ctx.leaves)
+        {
+            for(uint it : leaf->item_indices)
+            {
+                if(tree.items.at(it)->contains(p,false)) ids.insert(tree.items.at(it)->id);
+            }
+        }
+        found += ids.size();
+    }
+    report("Twseventree", how_many_seconds(t0,t1), how_many_seconds(t1,Time::now()), found);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int main()
+{
+    for(const Workload & w : { grid_faces(40), sphere(400, 200, 200000) })
+    {
+        printf("%s: %zu triangles, %zu queries\n", w.name, w.tris.size(), w.queries.size());
+        bench_octree       (w, 6, 100); // as in balancing_gridmesh
+        bench_spatial_tree<2>(w, 6, 100);
+        bench_twseventree  (w, 4, 100); // 3^4 = 81 cells per axis, vs 2^6 = 64
+        bench_spatial_tree<3>(w, 4, 100);
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Timings of SpatialTree vs Octree and Twseventree (console, no GUI)
+#
+#-------------------------------------------------
+
+QT      -= core gui
+CONFIG  += console c++17
+CONFIG  -= app_bundle
+
+TARGET   = bench_spatial_tree
+TEMPLATE = app
+
+SOURCES += \
+        bench_spatial_tree.cpp \
+    ../../cinolib/external/predicates/shewchuk.c
+
+DEFINES += CINOLIB_USES_EXACT_PREDICATES
+INCLUDEPATH += $$PWD/..
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/include
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/external/eigen
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/external/predicates
@@ -0,0 +1,361 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+// Regression tests of the 27tree: each test prints its outcome, and the exit code
+// is the number of failed tests
+
+#include <twseventree.h>
+#include <linear_twseventree.h>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <set>
+
+using namespace cinolib;
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// UV sphere of radius r centered in c, appended to verts/tris
+void add_sphere(std::vector<vec3d> & verts, std::vector<uint> & tris, const vec3d & c, const double r, const uint nu, const uint nv)
+{
+    uint base = (uint)verts.size();
+    for(uint j=0; j<=nv; ++j)
+    for(uint i=0; i<nu;  ++i)
+    {
+        double th = M_PI*j/nv, ph = 2*M_PI*i/nu;
+        verts.push_back(c + vec3d(std::sin(th)*std::cos(ph), std::sin(th)*std::sin(ph), std::cos(th))*r);
+    }
+    for(uint j=0; j<nv; ++j)
+    for(uint i=0; i<nu; ++i)
+    {
+        uint a = base + j*nu + i,     b = base + j*nu + (i+1)%nu;
+        uint c = base + (j+1)*nu + i, d = base + (j+1)*nu + (i+1)%nu;
+        tris.insert(tris.end(), { a, b, d, a, d, c });
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// two trees anchored to the same lattice, of a part that grew beyond the root of the first
+// one: the diff must match leaves by their lattice cells, as a set comparison of the leaf boxes
+bool test_lattice_diff()
+{
+    vec3d  origin(-0.3,-0.2,-0.1);
+    double base = 0.2;
+
+    std::vector<vec3d> va, vb;
+    std::vector<uint>  ta, tb;
+    add_sphere(va, ta, vec3d(0,0,0), 1, 60, 30);
+    vb = va;
+    tb = ta;
+    add_sphere(vb, tb, vec3d(8.5,0.3,-3.1), 0.1, 10, 5);
+
+    Twseventree a(4,10), b(4,10);
+    a.set_lattice(origin, base);
+    b.set_lattice(origin, base);
+    a.build_from_vectors(va, ta);
+    b.build_from_vectors(vb, tb);
+    LinearTwseventree la(a), lb(b);
+    if(la.bbox.min==lb.bbox.min && la.bbox.max==lb.bbox.max) return false; // the roots must differ
+
+    // leaf boxes in integer units of the finest cell either tree can have
+    double unit = base / LinearTwseventree::pow3(LinearTwseventree::max_level - std::min(la.lattice_levels, lb.lattice_levels));
+    auto key = [&](const LinearTwseventree & t, const uint lid)
+    {
+        AABB box = t.leaf_bbox(lid);
+        return std::array<long long,4>{ std::llround((box.min[0]-origin[0])/unit), std::llround((box.min[1]-origin[1])/unit),
+                                        std::llround((box.min[2]-origin[2])/unit), std::llround(box.delta()[0]/unit) };
+    };
+    std::set<std::array<long long,4>> ka, kb;
+    for(uint i=0; i<la.num_leaves(); ++i) ka.insert(key(la,i));
+    for(uint i=0; i<lb.num_leaves(); ++i) kb.insert(key(lb,i));
+
+    LinearTwseventreeDiff d = LinearTwseventree::diff(la, lb);
+    size_t removed = 0, added = 0;
+    for(uint i=0; i<la.num_leaves(); ++i) if(!kb.count(key(la,i))) ++removed;
+    for(uint i=0; i<lb.num_leaves(); ++i) if(!ka.count(key(lb,i))) ++added;
+    for(const auto & l : d.removed) if(kb.count(key(la,l.lid))) return false;
+    for(const auto & l : d.added)   if(ka.count(key(lb,l.lid))) return false;
+    for(const auto & r : d.unchanged)
+    for(uint k=0; k<r.count; ++k)   if(key(la,r.old_lid+k)!=key(lb,r.new_lid+k)) return false;
+
+    return d.removed.size()==removed && d.added.size()==added && d.num_unchanged>0 &&
+           d.num_unchanged + removed == la.num_leaves() &&
+           d.num_unchanged + added   == lb.num_leaves();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// rays with a zero direction hit nothing, in the single, packet and batch paths, and do not
+// disturb the other rays of their packet
+bool test_zero_direction_rays()
+{
+    std::vector<vec3d> verts;
+    std::vector<uint>  tris;
+    add_sphere(verts, tris, vec3d(0,0,0), 1, 40, 20);
+    Twseventree tree(5,10);
+    tree.build_from_vectors(verts, tris);
+
+    double t;
+    uint   id;
+    if(tree.intersects_ray(vec3d(0,0,0),   vec3d(0,0,0), t, id))    return false;
+    if(tree.intersects_ray(vec3d(0,0,0),   vec3d(0,0,0), t, id, 1)) return false;
+    if(tree.intersects_ray(vec3d(0,0,1),   vec3d(0,0,0), t, id))    return false; // on the surface
+    if(!tree.intersects_ray(vec3d(0,0,0),  vec3d(0,0,1), t, id))    return false;
+
+    std::vector<vec3d>  p   = { vec3d(0,0,0), vec3d(0,0,0), vec3d(0.1,0.2,0.3), vec3d(0,0,-3) };
+    std::vector<vec3d>  dir = { vec3d(0,0,0), vec3d(1,0,0), vec3d(0,0,0),       vec3d(0,0,1)  };
+    std::vector<double> ts;
+    std::vector<int>    ids;
+    for(int coherent=0; coherent<2; ++coherent)
+    {
+        tree.intersects_rays(p, dir, ts, ids, inf_double, coherent==1);
+        if(ids[0]!=-1 || ids[2]!=-1 || ts[0]!=inf_double || ts[2]!=inf_double) return false;
+        for(uint i : { 1u, 3u })
+        {
+            if(!tree.intersects_ray(p[i], dir[i], t, id) || ids[i]!=(int)id || ts[i]!=t) return false;
+        }
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// a snapshot loads back identical to the tree it was saved from, and files with a truncated
+// section, a bad level, out of range or decreasing item offsets, or unsorted codes are rejected
+bool test_snapshot()
+{
+    std::vector<vec3d> verts;
+    std::vector<uint>  tris;
+    add_sphere(verts, tris, vec3d(0,0,0), 1, 40, 20);
+    Twseventree tree(4,10);
+    tree.build_from_vectors(verts, tris);
+    LinearTwseventree lt(tree), ls;
+
+    const char *filename = "test_twseventree_snapshot.bin";
+    if(!lt.save(filename) || !ls.load(filename) || ls.num_leaves()!=lt.num_leaves()) return false;
+    for(uint i=0; i<lt.num_leaves(); ++i)
+    {
+        if(ls.leaf(i).code!=lt.leaf(i).code || ls.leaf(i).level!=lt.leaf(i).level ||
+           !std::equal(lt.leaf_items_begin(i), lt.leaf_items_end(i), ls.leaf_items_begin(i), ls.leaf_items_end(i))) return false;
+    }
+    if(LinearTwseventree::diff(lt, ls, true).num_unchanged!=lt.num_leaves()) return false;
+
+    std::ifstream in(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    LinearTwseventreeFileHeader h;
+    memcpy(&h, bytes.data(), sizeof(h));
+
+    // each corruption is written over a copy of the good file, which must then fail to load
+    auto rejected = [&](const std::function<void(std::vector<char>&)> & corrupt)
+    {
+        std::vector<char> b = bytes;
+        corrupt(b);
+        std::ofstream out(filename, std::ios::binary);
+        out.write(b.data(), b.size());
+        out.close();
+        return !ls.load(filename) && ls.num_leaves()==0;
+    };
+    auto leaf   = [&](std::vector<char> & b, const size_t i) { return reinterpret_cast<LinearTwseventreeLeaf*>(b.data() + h.leaves_at) + i; };
+    auto offset = [&](std::vector<char> & b, const size_t i) { return reinterpret_cast<uint*>(b.data() + h.offsets_at) + i; };
+    uint mid = lt.num_leaves()/2;
+    while(lt.leaf_num_items(mid)==0) ++mid;
+    bool ok = rejected([&](std::vector<char> & b) { b.resize(b.size()-4); })                                  &&
+              rejected([&](std::vector<char> & b) { leaf(b,mid)->level = LinearTwseventree::max_level+1; })    &&
+              rejected([&](std::vector<char> & b) { *offset(b,mid) = (uint)h.num_items+1; })                   &&
+              rejected([&](std::vector<char> & b) { *offset(b,mid+1) = *offset(b,mid)-1; })                    &&
+              rejected([&](std::vector<char> & b) { std::swap(leaf(b,mid)->code, leaf(b,mid+1)->code); })      &&
+              rejected([&](std::vector<char> & b) { leaf(b,mid)->code += 1; });
+    std::remove(filename);
+    return ok;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// the neighbors of each leaf, and their kinds, are those found by comparing the grid ranges of all
+// pairs of leaves. Hence the relation is symmetric, and the adjacency table lists the same ones
+bool test_neighbors()
+{
+    std::vector<vec3d> verts;
+    std::vector<uint>  tris;
+    add_sphere(verts, tris, vec3d(0,0,0), 1, 40, 20);
+    Twseventree tree(3,10);
+    tree.build_from_vectors(verts, tris);
+    LinearTwseventree lt(tree);
+    lt.build_adjacency();
+
+    uint n = lt.num_leaves();
+    std::vector<std::array<uint,4>> cells(n); // min grid corner and extent
+    for(uint i=0; i<n; ++i)
+    {
+        LinearTwseventree::decode(lt.leaf(i).code, cells[i][0], cells[i][1], cells[i][2]);
+        cells[i][3] = LinearTwseventree::pow3(LinearTwseventree::max_level - lt.leaf(i).level);
+    }
+    std::vector<std::set<std::pair<uint,uint>>> nbrs(n); // (lid, kind)
+    for(uint i=0; i<n; ++i)
+    {
+        std::vector<LinearTwseventreeNeighbor> tmp;
+        lt.find_neighbors(i, tmp);
+        if(tmp.size()!=lt.num_neighbors(i) || !std::equal(tmp.begin(), tmp.end(), lt.neighbors_begin(i), [](const LinearTwseventreeNeighbor & a, const LinearTwseventreeNeighbor & b)
+        {
+            return a.lid==b.lid && a.level==b.level && a.kind==b.kind;
+        })) return false;
+        for(const auto & nbr : tmp) nbrs[i].insert({ nbr.lid, nbr.kind });
+    }
+    for(uint i=0; i<n; ++i)
+    {
+        std::set<std::pair<uint,uint>> ref;
+        for(uint j=0; j<n; ++j)
+        {
+            uint touch = 0, apart = 0;
+            for(int k=0; k<3; ++k)
+            {
+                uint a0 = cells[i][k], a1 = a0 + cells[i][3];
+                uint b0 = cells[j][k], b1 = b0 + cells[j][3];
+                if(a1==b0 || b1==a0) ++touch; else
+                if(a1<b0  || b1<a0 ) ++apart;
+            }
+            if(j!=i && touch>0 && apart==0) ref.insert({ j, touch-1 });
+        }
+        if(ref!=nbrs[i]) return false;
+        for(const auto & nbr : nbrs[i]) if(!nbrs[nbr.first].count({ i, nbr.second })) return false;
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// the budgeted refinement never predicts more cells than the budget, and an anchored tree is split
+// down to the base cells of its lattice even if they alone exceed the budget
+bool test_cell_budget()
+{
+    std::vector<vec3d> verts;
+    std::vector<uint>  tris;
+    add_sphere(verts, tris, vec3d(0,0,0), 1, 40, 20);
+    add_sphere(verts, tris, vec3d(2.2,0.3,0), 0.5, 20, 10);
+    for(size_t budget : { 1000, 5000, 20000, 100000 })
+    {
+        Twseventree tree(6,1);
+        tree.set_cell_budget(budget);
+        tree.build_from_vectors(verts, tris);
+        if(tree.predict_num_cells()>budget || tree.predict_num_cells()<budget/4) return false;
+    }
+
+    Twseventree tree(6,1);
+    tree.set_lattice(vec3d(0,0,0), 0.25);
+    tree.set_cell_budget(100);
+    tree.build_from_vectors(verts, tris);
+    bool coarse = false;
+    tree.for_each_leaf([&](const AABB &, const TwseventreeNode *, const uint depth)
+    {
+        if(depth<tree.lattice_base_depth()) coarse = true;
+    });
+    return !coarse && tree.lattice_base_depth()>2;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// removing some triangles and inserting them back gives the leaves and the item lists of a tree
+// built from scratch (compared through the CSR lists, which must follow the edits), and right after
+// the removal no list holds a removed triangle
+bool test_edits()
+{
+    std::vector<vec3d> verts;
+    std::vector<uint>  tris;
+    add_sphere(verts, tris, vec3d(0,0,0), 1, 40, 20);
+    uint n_first = (uint)tris.size()/3;
+    add_sphere(verts, tris, vec3d(0.6,0.2,0.1), 0.3, 20, 10);
+    uint n_tris = (uint)tris.size()/3;
+
+    // (leaf box, sorted triangle ids) of the leaves with items, from the CSR lists
+    typedef std::pair<std::array<double,6>,std::vector<uint>> LeafItems;
+    auto leaf_items = [](Twseventree & tree)
+    {
+        std::vector<LeafItems> out;
+        const std::vector<uint> & offsets = tree.leaf_item_offsets();
+        const std::vector<uint> & ids     = tree.leaf_item_indices();
+        if(offsets.size()!=tree.leaves.size()+1) return out;
+        for(uint i=0; i<tree.leaves.size(); ++i)
+        {
+            const TwseventreeNode *l = tree.leaves.at(i);
+            if(l->item_indices.size()!=offsets.at(i+1)-offsets.at(i) ||
+               !std::equal(l->item_indices.begin(), l->item_indices.end(), ids.begin()+offsets.at(i))) return std::vector<LeafItems>();
+            if(l->item_indices.empty()) continue;
+            LeafItems li;
+            li.first = { l->bbox.min[0], l->bbox.min[1], l->bbox.min[2], l->bbox.max[0], l->bbox.max[1], l->bbox.max[2] };
+            for(uint k=offsets.at(i); k<offsets.at(i+1); ++k) li.second.push_back(tree.items.at(ids.at(k))->id);
+            std::sort(li.second.begin(), li.second.end());
+            out.push_back(li);
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    };
+
+    Twseventree ref(5,20), tree(5,20);
+    ref.build_from_vectors(verts, tris);
+    tree.build_from_vectors(verts, tris);
+
+    std::vector<uint> ids, second(tris.begin()+3*n_first, tris.end());
+    for(uint i=n_first; i<n_tris; ++i) ids.push_back(i);
+    tree.remove_triangles(ids);
+    std::vector<LeafItems> removed = leaf_items(tree);
+    if(removed.empty()) return false;
+    for(const LeafItems & li : removed)
+    {
+        if(li.second.back()>=n_first) return false;
+    }
+
+    tree.insert_triangles(verts, second, ids);
+    std::vector<LeafItems> expected = leaf_items(ref);
+    return !expected.empty() && leaf_items(tree)==expected;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int main()
+{
+    int failed = 0;
+    auto run = [&](const char *name, bool (*test)())
+    {
+        bool ok = test();
+        std::cout << (ok ? "PASS " : "FAIL ") << name << std::endl;
+        if(!ok) ++failed;
+    };
+    run("lattice_diff",        test_lattice_diff);
+    run("zero_direction_rays", test_zero_direction_rays);
+    run("snapshot",            test_snapshot);
+    run("neighbors",           test_neighbors);
+    run("cell_budget",         test_cell_budget);
+    run("edits",               test_edits);
+    return failed;
+}
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Regression tests of the 27tree (console, no GUI)
+#
+#-------------------------------------------------
+
+QT      -= core gui
+CONFIG  += console c++17
+CONFIG  -= app_bundle
+
+TARGET   = test_twseventree
+TEMPLATE = app
+
+SOURCES += \
+        test_twseventree.cpp \
+    ../../cinolib/external/predicates/shewchuk.c
+
+DEFINES += CINOLIB_USES_EXACT_PREDICATES
+INCLUDEPATH += $$PWD/..
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/include
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/external/eigen
+INCLUDEPATH +=/home/tesi/Scrivania/cinolib/external/predicates
@@ -28,6 +28,7 @@
 *********************************************************************************/
 
 #include <twseventree.h>
+#include <work_stealing_pool.h>
 #include <cinolib/how_many_seconds.h>
 #include <cinolib/parallel_for.h>
 #include <cinolib/geometry/point.h>
@@ -35,24 +36,214 @@
 #include <cinolib/geometry/segment.h>
 #include <cinolib/geometry/triangle.h>
 #include <cinolib/geometry/tetrahedron.h>
+#include <cinolib/predicates.h>
 #include <stack>
+#include <array>
+#include <bitset>
+#include <limits>
+#include <cmath>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <functional>
+#include <new>
+#include <type_traits>
 
 namespace cinolib
 {
 
 CINO_INLINE
-TwseventreeNode::~TwseventreeNode()
+TwseventreeNodePool::TwseventreeNodePool(const uint min_chunk_size,
+                                         const uint max_chunk_size)
+: min_chunk_size(min_chunk_size)
+, max_chunk_size(max_chunk_size)
+{}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeNodePool::~TwseventreeNodePool()
 {
-    // "in a tree's node destructor, you only need to destroy the children pointers that are manually
-    //  allocated by you. You don't need to worry about the deallocation of the node itself."
-    //  https://stackoverflow.com/questions/34170164/destructor-for-binary-search-tree
-    for(int i=0; i<27; ++i)
+    clear();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeNode * TwseventreeNodePool::alloc(const TwseventreeNode * father, const AABB * bboxes, const uint n)
+{
+    TwseventreeNode *block;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(chunks.empty() || chunks.back().used + n > chunks.back().size)
+        {
+            // chunks grow geometrically, so that small trees stay small and big trees
+            // do not call the allocator more than a handful of times
+            uint size = (chunks.empty()) ? min_chunk_size : std::min(2*chunks.back().size, max_chunk_size);
+            size = std::max(size, n);
+
+            Chunk c;
+            c.data = static_cast<TwseventreeNode*>(::operator new(size*sizeof(TwseventreeNode)));
+            c.size = size;
+            c.used = 0;
+            chunks.push_back(c);
+            bytes_count += size*sizeof(TwseventreeNode);
+        }
+
+        block = chunks.back().data + chunks.back().used;
+        chunks.back().used += n;
+        nodes_count        += n;
+    }
+
+    // construction happens outside of the lock: the block is already reserved to this thread
+    for(uint i=0; i<n; ++i) new (block+i) TwseventreeNode(father, bboxes[i]);
+    return block;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeNodePool::clear()
+{
+    for(auto & c : chunks)
+    {
+        if(!std::is_trivially_destructible<TwseventreeNode>::value)
+        {
+            for(uint i=0; i<c.used; ++i) c.data[i].~TwseventreeNode();
+        }
+        ::operator delete(c.data);
+    }
+    chunks.clear();
+    nodes_count = 0;
+    bytes_count = 0;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeNodePool::Checkpoint TwseventreeNodePool::checkpoint() const
+{
+    Checkpoint c;
+    c.chunks = chunks.size();
+    c.used   = chunks.empty() ? 0 : chunks.back().used;
+    c.nodes  = nodes_count;
+    return c;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeNodePool::reset(const Checkpoint & c)
+{
+    assert(c.chunks<=chunks.size());
+    for(size_t i=(c.chunks>0) ? c.chunks-1 : 0; i<chunks.size(); ++i)
     {
-        if(children[i]!=nullptr)
+        Chunk & ch   = chunks.at(i);
+        uint    keep = (i+1==c.chunks) ? c.used : 0;
+        if(!std::is_trivially_destructible<TwseventreeNode>::value)
+        {
+            for(uint j=keep; j<ch.used; ++j) ch.data[j].~TwseventreeNode();
+        }
+        ch.used = keep;
+        if(i>=c.chunks)
         {
-            delete children[i];
+            ::operator delete(ch.data);
+            bytes_count -= ch.size*sizeof(TwseventreeNode);
         }
     }
+    chunks.resize(c.chunks);
+    nodes_count = c.nodes;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeIndexPool::TwseventreeIndexPool(const size_t chunk_size)
+: chunk_size(chunk_size)
+{}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeIndexPool::~TwseventreeIndexPool()
+{
+    clear();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint * TwseventreeIndexPool::alloc(const size_t n)
+{
+    if(n==0) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(chunks.empty() || chunks.back().used + n > chunks.back().size)
+    {
+        // big lists (e.g. the root) get a chunk of their own
+        Chunk c;
+        c.size = std::max(n, chunk_size);
+        c.data = static_cast<uint*>(::operator new(c.size*sizeof(uint)));
+        c.used = 0;
+        chunks.push_back(c);
+        bytes_count += c.size*sizeof(uint);
+    }
+    uint *ptr = chunks.back().data + chunks.back().used;
+    chunks.back().used += n;
+    return ptr;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeIndexPool::clear()
+{
+    for(auto & c : chunks) ::operator delete(c.data);
+    chunks.clear();
+    bytes_count = 0;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+TwseventreeIndexPool::Checkpoint TwseventreeIndexPool::checkpoint() const
+{
+    Checkpoint c;
+    c.chunks = chunks.size();
+    c.used   = chunks.empty() ? 0 : chunks.back().used;
+    return c;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeIndexPool::reset(const Checkpoint & c)
+{
+    assert(c.chunks<=chunks.size());
+    for(size_t i=c.chunks; i<chunks.size(); ++i)
+    {
+        ::operator delete(chunks.at(i).data);
+        bytes_count -= chunks.at(i).size*sizeof(uint);
+    }
+    chunks.resize(c.chunks);
+    if(c.chunks>0) chunks.back().used = c.used;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeQueryContext::begin(const uint n_items)
+{
+    ids.clear();
+    leaves.clear();
+    stack.clear();
+    if(stamps.size()<n_items) stamps.resize(n_items, 0); // only when the tree grew
+    if(++stamp==0) // wrapped around: old stamps could match again
+    {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        stamp = 1;
+    }
 }
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -62,6 +253,10 @@ Twseventree::Twseventree(const uint max_depth,
                const uint items_per_leaf)
 : max_depth(max_depth)
 , items_per_leaf(items_per_leaf)
+, exact_rejections(0)
+, vector_allocs_estimate(0)
+, implicit_leaves(0)
+, dropped_cells(0)
 {}
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -69,8 +264,13 @@ Twseventree::Twseventree(const uint max_depth,
 CINO_INLINE
 Twseventree::~Twseventree()
 {
-    // delete Octree
-    if(root!=nullptr) delete root;
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    // delete 27tree (all nodes live in the pool)
+    size_t n_nodes = pool.num_nodes();
+    pool.clear();
+    root = nullptr;
 
     // delete item list
     while(!items.empty())
@@ -78,6 +278,12 @@ Twseventree::~Twseventree()
         delete items.back();
         items.pop_back();
     }
+
+    if(print_debug_info && n_nodes>0)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << "27tree freed (" << how_many_seconds(t0,t1) << "s, " << n_nodes << " nodes)" << std::endl;
+    }
 }
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -88,97 +294,194 @@ void Twseventree::build()
     typedef std::chrono::high_resolution_clock Time;
     Time::time_point t0 = Time::now();
 
-    if(items.empty()) return;
+    if(num_items()==0) return;
 
     // initialize root with all items, also updating its AABB
     assert(root==nullptr);
-    root = new TwseventreeNode(nullptr, AABB());
-    root->item_indices.resize(items.size());
+    AABB root_bbox;
+    root = pool.alloc(nullptr, &root_bbox, 1);
+    root->item_indices.ptr   = index_pool.alloc(num_items());
+    root->item_indices.count = num_items();
     std::iota(root->item_indices.begin(),root->item_indices.end(),0);
-    for(auto it : items) root->bbox.push(it->aabb);
+    root->bbox = items_bbox();
+    brick      = root->bbox;
+    brick_side = 0;
+
+    lattice_levels = 0;
+    if(lattice_base>0) anchor_root_to_lattice();
+
+    init_refinement_criteria();
 
     //root->bbox.scale(1.5); // enlarge bbox to account for queries outside legal area.
                            // this should disappear eventually....
 
-    if(root->item_indices.size()<items_per_leaf || max_depth==1)
+    exact_rejections       = 0;
+    vector_allocs_estimate = 0;
+    implicit_leaves        = 0;
+    dropped_cells          = 0;
+    dense_levels_built     = 0;
+
+    // per thread statistics of the parallel build (one entry per worker)
+    std::vector<WorkStealingPool::WorkerStats> worker_stats;
+    std::vector<size_t>                        worker_items;
+
+    bool root_is_leaf = (sizing_field || max_normal_deviation>0) ? !needs_split(root,1)
+                                                                 : (root->item_indices.size()<items_per_leaf || max_depth==1);
+    if(root_is_leaf && lattice_levels==0)
     {
         leaves.push_back(root);
         tree_depth = 1;
     }
-    else
+    else if(cell_budget>0)
     {
         subdivide(root);
-
-        if(max_depth==2)
-        {
-            tree_depth = 2;
-            for(int i=0; i<27; ++i) leaves.push_back(root->children[i]);
-        }
+        refine_with_budget();
+    }
+    else
+    {
+        // seeds of the recursive refinement: the children of the root, or the frontier
+        // of the dense top levels in the hybrid build (with their depth)
+        std::vector<std::pair<TwseventreeNode*,uint>> seeds;
+        bool dense = dense_levels>0 && max_depth+lattice_levels>2 && !exact_triangle_box &&
+                     !sizing_field && max_normal_deviation<=0;
+        if(dense) build_dense_levels(seeds);
         else
         {
-            // WORK IN PARALLEL ON EACH OCTANT
-            // To fully avoid syncrhonization between the threads global information
-            // such as vector of leaves and tree depth are duplicated, and will be
-            // merged after convergence.
-
-            uint octant_depth[27] = { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 };
-            std::vector<const TwseventreeNode*> octant_leaves[27];
-
-            std::queue<std::pair<TwseventreeNode*,uint>> splitlist[27]; // (node, depth)
+            subdivide(root);
             for(int i=0; i<27; ++i)
             {
-                if(root->children[i]->item_indices.size()>items_per_leaf)
-                {
-                    splitlist[i].push(std::make_pair(root->children[i],2));
-                }
-                else octant_leaves[i].push_back(root->children[i]);
+                if(root->children[i]!=nullptr) seeds.push_back(std::make_pair(root->children[i], 2u));
             }
+        }
+
+        // WORK STEALING BUILD
+        // Every node that must be split becomes a task, at any depth. Workers process their
+        // own tasks depth first, and idle workers steal the biggest pending tasks from the
+        // others, so that load stays balanced even if the surface lives in a few octants.
+        // To avoid synchronization, global information such as vector of leaves and tree
+        // depth are duplicated per worker, and will be merged after convergence.
+
+        WorkStealingPool tasks;
+        uint nt = tasks.num_threads();
 
-            PARALLEL_FOR(0,27,0,[&](uint i)
+        std::vector<std::vector<const TwseventreeNode*>> thread_leaves(nt);
+        std::vector<uint>                                thread_depth(nt, 2);
+        worker_items.resize(nt, 0);
+
+        std::function<void(TwseventreeNode*,const uint,const uint)> split = [&](TwseventreeNode *node, const uint depth, const uint worker)
+        {
+            worker_items.at(worker) += node->item_indices.size();
+            subdivide(node);
+
+            for(int i=0; i<27; ++i)
             {
-                while(!splitlist[i].empty())
+                TwseventreeNode *child = node->children[i];
+                if(child==nullptr) continue;
+                if(needs_split(child, depth+1))
                 {
-                    auto pair  = splitlist[i].front();
-                    auto node  = pair.first;
-                    uint depth = pair.second + 1;
-                    splitlist[i].pop();
-
-                    subdivide(node);
-
-                    for(int j=0; j<27; ++j)
-                    {
-                        if(depth<max_depth && node->children[j]->item_indices.size()>items_per_leaf)
-                        {
-                            splitlist[i].push(std::make_pair(node->children[j], depth));
-                        }
-                        else octant_leaves[i].push_back(node->children[j]);
-                    }
-
-                    octant_depth[i] = std::max(octant_depth[i], depth);
+                    tasks.push(worker, [&split,child,depth](const uint w){ split(child, depth+1, w); });
                 }
-            });
+                else thread_leaves.at(worker).push_back(child);
+            }
+            thread_depth.at(worker) = std::max(thread_depth.at(worker), depth+1);
+        };
 
-            // global merge of octant data
-            tree_depth = *std::max_element(octant_depth, octant_depth+27);
-            for(int i=0; i<27; ++i)
+        for(uint i=0; i<seeds.size(); ++i)
+        {
+            TwseventreeNode *child = seeds.at(i).first;
+            uint             depth = seeds.at(i).second;
+            thread_depth.front() = std::max(thread_depth.front(), depth);
+            if(needs_split(child, depth))
             {
-                std::copy(octant_leaves[i].begin(), octant_leaves[i].end(), std::back_inserter(leaves));
+                tasks.push(i%nt, [&split,child,depth](const uint w){ split(child, depth, w); });
             }
+            else thread_leaves.front().push_back(child);
+        }
+
+        tasks.run();
+        worker_stats = tasks.stats();
+
+        // global merge of thread data
+        tree_depth = *std::max_element(thread_depth.begin(), thread_depth.end());
+        for(uint i=0; i<nt; ++i)
+        {
+            std::copy(thread_leaves.at(i).begin(), thread_leaves.at(i).end(), std::back_inserter(leaves));
         }
     }
 
+    size_t index_peak_bytes  = index_pool.num_bytes();
+    size_t index_peak_allocs = index_pool.num_allocs();
+    compact_item_indices();
+
     if(print_debug_info)
     {
         Time::time_point t1 = Time::now();
         double t = how_many_seconds(t0,t1);
         std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
         std::cout << "27tree created (" << t << "s)                      " << std::endl;
-        std::cout << "#Items                   : " << items.size()         << std::endl;
-        std::cout << "#Leaves                  : " << leaves.size()        << std::endl;
+        std::cout << "#Items                   : " << num_items()          << std::endl;
+        if(triangle_soa)
+        {
+            std::cout << "Triangle storage (SoA)   : " << soa_tris.num_bytes()/(1024.0*1024.0) << "MB" << std::endl;
+        }
+        std::cout << "#Leaves                  : " << leaves.size()        << " (+" << implicit_leaves.load() << " implicit empty leaves)" << std::endl;
+        if(lattice_base>0)
+        {
+            std::cout << "Lattice                  : base " << lattice_base << ", root of 3^" << lattice_levels << " base cells, "
+                      << brick_cubes[0] << "x" << brick_cubes[1] << "x" << brick_cubes[2] << " base cells covered" << std::endl;
+        }
+        else if(root_brick && root->is_inner)
+        {
+            std::cout << "Root brick               : " << brick_cubes[0] << "x" << brick_cubes[1] << "x" << brick_cubes[2]
+                      << " cubes at depth " << brick_levels+1 << " (" << dropped_cells.load() << " cells dropped)" << std::endl;
+        }
+        if(dense_levels_built>0)
+        {
+            std::cout << "Dense top levels         : " << dense_levels_built << " (" << dense_occupied << " occupied cells at depth "
+                      << dense_levels_built+1 << ", " << dense_time << "s)" << std::endl;
+        }
+        if(cell_budget>0)
+        {
+            std::cout << "Cell budget              : " << cell_budget << ", predicted " << predicted_cells
+                      << " cells after balancing and transitions (" << prediction_passes << " prediction passes)" << std::endl;
+        }
+        std::cout << "#Nodes                   : " << pool.num_nodes()     << std::endl;
+        std::cout << "Node pool                : " << pool.num_bytes()/(1024.0*1024.0) << "MB in " << pool.num_chunks() << " chunks" << std::endl;
         std::cout << "Max depth                : " << max_depth            << std::endl;
         std::cout << "Depth                    : " << tree_depth           << std::endl;
-        std::cout << "Prescribed items per leaf: " << items_per_leaf       << std::endl;
+        if(sizing_field || max_normal_deviation>0)
+        {
+            std::cout << "Refinement               : ";
+            if(sizing_field)           std::cout << "sizing field ";
+            if(max_normal_deviation>0) std::cout << "normal deviation " << max_normal_deviation*180.0/M_PI << "deg";
+            std::cout << std::endl;
+        }
+        else std::cout << "Prescribed items per leaf: " << items_per_leaf       << std::endl;
         std::cout << "Max items per leaf       : " << max_items_per_leaf() << std::endl;
+        std::cout << "Item indices (peak)      : " << index_peak_bytes/(1024.0*1024.0) << "MB in " << index_peak_allocs << " allocations "
+                  << "(~" << vector_allocs_estimate.load() << " with per node vectors)" << std::endl;
+        std::cout << "Item indices (CSR)       : " << (leaf_item_ids.capacity()+leaf_offsets.capacity())*sizeof(uint)/(1024.0*1024.0) << "MB" << std::endl;
+        if(exact_triangle_box)
+        {
+            std::cout << "Exact tri/box rejections : " << exact_rejections.load() << " (item,child) pairs" << std::endl;
+        }
+        if(!worker_stats.empty())
+        {
+            size_t max_items = *std::max_element(worker_items.begin(), worker_items.end());
+            size_t tot_items = std::accumulate(worker_items.begin(), worker_items.end(), size_t(0));
+            for(uint i=0; i<worker_stats.size(); ++i)
+            {
+                std::cout << "Thread " << i << "                 : "
+                          << worker_stats.at(i).executed  << " splits ("
+                          << worker_stats.at(i).stolen    << " stolen), "
+                          << worker_items.at(i)           << " items, "
+                          << worker_stats.at(i).busy_time << "s busy" << std::endl;
+            }
+            if(tot_items>0)
+            {
+                std::cout << "Load imbalance (max/avg) : " << max_items*worker_items.size()/double(tot_items) << std::endl;
+            }
+        }
         std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
     }
 }
@@ -186,128 +489,2473 @@ void Twseventree::build()
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
 CINO_INLINE
-void Twseventree::subdivide(TwseventreeNode * node)
+bool Twseventree::needs_split(const TwseventreeNode * node, const uint depth) const
 {
-    // create children octants
-    vec3d min = node->bbox.min;
-    vec3d max = node->bbox.max;
-
-
-    if(this->root == node){
-
-        vec3d max_lato = (vec3d(abs(max.x() - min.x()), abs(max.y() - min.y()), abs(max.z() - min.z())));
-
-        double diff_x;
-        double diff_y;
-        double diff_z;
+    if(depth<=lattice_levels) return true; // coarser than the base cells of the lattice
+    if(depth>=max_depth+lattice_levels) return false;
+    if(!sizing_field && max_normal_deviation<=0) return node->item_indices.size()>items_per_leaf;
 
-        if(max_lato.x() > max_lato.y() && max_lato.x() > max_lato.z()){
-            diff_y = max_lato.x() - max_lato.y();
-            diff_z = max_lato.x() - max_lato.z();
-            node->bbox.push(vec3d(min.x(), min.y() - (diff_y/2),  min.z() - (diff_z/2)));
-            node->bbox.push(vec3d(max.x(), max.y() + (diff_y/2),  max.z() + (diff_z/2)));
+    if(sizing_field)
+    {
+        double side = node->bbox.delta().max_entry();
+        for(uint it : node->item_indices)
+        {
+            if(side > item_target_size[it]) return true;
         }
-        else if(max_lato.y() > max_lato.x() && max_lato.y() > max_lato.z()){
-            diff_x = max_lato.y() - max_lato.x();
-            diff_z = max_lato.y() - max_lato.z();
-            node->bbox.push(vec3d(min.x() - (diff_x/2), min.y(), min.z() - (diff_z/2)));
-            node->bbox.push(vec3d(max.x() + (diff_x/2), max.y(), max.z() + (diff_z/2)));
+    }
+    if(max_normal_deviation>0)
+    {
+        // facets are flat: a leaf smaller than one of its triangles cannot resolve any more of
+        // the shape, whatever the angle between its facets (e.g. along the edges of a coarse mesh)
+        double       side    = node->bbox.delta().max_entry();
+        double       cos_max = std::cos(max_normal_deviation);
+        const vec3d *ref     = nullptr;
+        for(uint it : node->item_indices)
+        {
+            if(side < item_triangle_size[it]) return false;
         }
-        else{
-            diff_x = max_lato.z() - max_lato.x();
-            diff_y = max_lato.z() - max_lato.y();
-            node->bbox.push(vec3d(min.x() - (diff_x/2),  min.y() - (diff_y/2), min.z()));
-            node->bbox.push(vec3d(max.x() + (diff_x/2),  max.y() + (diff_y/2), max.z()));
+        for(uint it : node->item_indices)
+        {
+            const vec3d & n = item_normals[it];
+            if(n.length_squared()==0) continue;
+            if(ref==nullptr) ref = &n;
+            else if(ref->dot(n) < cos_max) return true;
         }
-
-
-        max = node->bbox.max;
-        min = node->bbox.min;
-
     }
+    return false;
+}
 
-    vec3d avg1 = min + ((vec3d(abs(max.x() - min.x()), abs(max.y() - min.y()), abs(max.z() - min.z())))/3);
-    vec3d avg2 = max - ((vec3d(abs(max.x() - min.x()), abs(max.y() - min.y()), abs(max.z() - min.z())))/3);
-
-
-    node->children[0] = new TwseventreeNode(node, AABB(vec3d(min[0], min[1], min[2]), vec3d(avg1[0], avg1[1], avg1[2])));
-    node->children[1] = new TwseventreeNode(node, AABB(vec3d(avg1[0], min[1], min[2]), vec3d(avg2[0], avg1[1], avg1[2])));
-    node->children[2] = new TwseventreeNode(node, AABB(vec3d(avg2[0], min[1], min[2]), vec3d(max[0], avg1[1], avg1[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+void Twseventree::init_refinement_criteria(const uint first_item)
+{
+    // per item data of the refinement criteria, computed once in parallel
+    // (the sizing field is evaluated concurrently, hence it must be thread safe)
+    if(first_item==0)
+    {
+        item_target_size.clear();
+        item_normals.clear();
+        item_triangle_size.clear();
+    }
+    uint n = num_items();
+    if(sizing_field) item_target_size.resize(n);
+    if(max_normal_deviation>0)
+    {
+        item_normals.resize(n, vec3d(0,0,0));
+        item_triangle_size.resize(n, 0);
+    }
+    if(!sizing_field && max_normal_deviation<=0) return;
+    PARALLEL_FOR(first_item, n, 1000, [&](uint it){ item_refinement_criteria(it); });
+}
 
-    node->children[3] = new TwseventreeNode(node, AABB(vec3d(min[0], avg1[1], min[2]), vec3d(avg1[0], avg2[1], avg1[2])));
-    node->children[4] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg1[1], min[2]), vec3d(avg2[0], avg2[1], avg1[2])));
-    node->children[5] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg1[1], min[2]), vec3d(max[0], avg2[1], avg1[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+void Twseventree::update_refinement_criteria(const std::vector<uint> & its)
+{
+    if(!sizing_field && max_normal_deviation<=0) return;
+    PARALLEL_FOR(0, (uint)its.size(), 1000, [&](uint i){ item_refinement_criteria(its.at(i)); });
+}
 
-    node->children[6] = new TwseventreeNode(node, AABB(vec3d(min[0], avg2[1], min[2]), vec3d(avg1[0], max[1], avg1[2])));
-    node->children[7] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg2[1], min[2]), vec3d(avg2[0], max[1], avg1[2])));
-    node->children[8] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg2[1], min[2]), vec3d(max[0], max[1], avg1[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+void Twseventree::item_refinement_criteria(const uint it)
+{
+    vec3d t[3];
+    bool  is_tri = true;
+    if(triangle_soa) for(uint k=0; k<3; ++k) t[k] = soa_tris.vert(it,k);
+    else if(items.at(it)->item_type()==TRIANGLE)
+    {
+        const Triangle *tri = static_cast<const Triangle*>(items.at(it));
+        for(uint k=0; k<3; ++k) t[k] = tri->v[k];
+    }
+    else is_tri = false;
 
-    node->children[9] = new TwseventreeNode(node, AABB(vec3d(min[0], min[1], avg1[2]), vec3d(avg1[0], avg1[1], avg2[2])));
-    node->children[10] = new TwseventreeNode(node, AABB(vec3d(avg1[0], min[1], avg1[2]), vec3d(avg2[0], avg1[1], avg2[2])));
-    node->children[11] = new TwseventreeNode(node, AABB(vec3d(avg2[0], min[1], avg1[2]), vec3d(max[0], avg1[1], avg2[2])));
+    if(sizing_field)
+    {
+        double size;
+        if(is_tri)
+        {
+            size = sizing_field((t[0]+t[1]+t[2])/3.0);
+            for(uint k=0; k<3; ++k) size = std::min(size, sizing_field(t[k]));
+        }
+        else size = sizing_field(item_aabb(it).center());
+        item_target_size[it] = size;
+    }
 
+    if(max_normal_deviation>0 && is_tri)
+    {
+        vec3d nrm = (t[1]-t[0]).cross(t[2]-t[0]);
+        nrm.normalize();
+        item_normals[it]       = nrm;
+        item_triangle_size[it] = std::max(t[0].dist(t[1]), std::max(t[1].dist(t[2]), t[2].dist(t[0])));
+    }
+}
 
-    node->children[12] = new TwseventreeNode(node, AABB(vec3d(min[0], avg1[1], avg1[2]), vec3d(avg1[0], avg2[1], avg2[2])));
-    node->children[13] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg1[1], avg1[2]), vec3d(avg2[0], avg2[1], avg2[2])));
-    node->children[14] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg1[1], avg1[2]), vec3d(max[0], avg2[1], avg2[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+double TwseventreeSizingGrid::operator()(const vec3d & p) const
+{
+    assert(values.size()==size_t(n[0])*n[1]*n[2] && n[0]>0 && n[1]>0 && n[2]>0);
 
-    node->children[15] = new TwseventreeNode(node, AABB(vec3d(min[0], avg2[1], avg1[2]), vec3d(avg1[0], max[1], avg2[2])));
-    node->children[16] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg2[1], avg1[2]), vec3d(avg2[0], max[1], avg2[2])));
-    node->children[17] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg2[1], avg1[2]), vec3d(max[0], max[1], avg2[2])));
+    uint   i0[3];
+    double w[3];
+    for(int c=0; c<3; ++c)
+    {
+        double d = box.delta()[c];
+        double x = (d>0 && n[c]>1) ? (p[c]-box.min[c]) / d * (n[c]-1) : 0;
+        x     = std::max(0.0, std::min(double(n[c]-1), x));
+        i0[c] = std::min(uint(x), (n[c]>1) ? n[c]-2 : 0);
+        w[c]  = (n[c]>1) ? x - i0[c] : 0;
+    }
 
+    double v = 0;
+    for(uint k=0; k<2; ++k)
+    for(uint j=0; j<2; ++j)
+    for(uint i=0; i<2; ++i)
+    {
+        double wi = (i ? w[0] : 1-w[0]) * (j ? w[1] : 1-w[1]) * (k ? w[2] : 1-w[2]);
+        if(wi==0) continue;
+        uint x = i0[0]+i, y = i0[1]+j, z = i0[2]+k;
+        v += wi * values.at(x + n[0]*(y + n[1]*z));
+    }
+    return v;
+}
 
-    node->children[18] = new TwseventreeNode(node, AABB(vec3d(min[0], min[1], avg2[2]), vec3d(avg1[0], avg1[1], max[2])));
-    node->children[19] = new TwseventreeNode(node, AABB(vec3d(avg1[0], min[1], avg2[2]), vec3d(avg2[0], avg1[1], max[2])));
-    node->children[20] = new TwseventreeNode(node, AABB(vec3d(avg2[0], min[1], avg2[2]), vec3d(max[0], avg1[1], max[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+uint Twseventree::node_depth(const TwseventreeNode * node) const
+{
+    uint depth = 1;
+    for(; node->father!=nullptr; node=node->father) ++depth;
+    return depth;
+}
 
-    node->children[21] = new TwseventreeNode(node, AABB(vec3d(min[0], avg1[1], avg2[2]), vec3d(avg1[0], avg2[1], max[2])));
-    node->children[22] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg1[1], avg2[2]), vec3d(avg2[0], avg2[1], max[2])));
-    node->children[23] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg1[1], avg2[2]), vec3d(max[0], avg2[1], max[2])));
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+CINO_INLINE
+void Twseventree::refine_with_budget()
+{
+    // Leaves are split in order of decreasing error, in batches sized on the budget left: after each
+    // batch the final number of cells is predicted again, and the next batch is half of the splits
+    // that would fill the remaining budget at the cost per split observed so far (and at most as
+    // many as to double the leaves). A batch that exceeds the budget is undone and retried with
+    // half of the splits, hence the budget is never exceeded, and refinement stops when a single
+    // split would exceed it. Anchored trees are first split down to the base cells of the lattice,
+    // which count toward the budget but are not subject to it: the budget is exceeded only if the
+    // base cells alone exceed it
+    double root_side = root->bbox.delta().max_entry();
+
+    PrioQueue q;
+    auto push = [&](TwseventreeNode *node, const uint depth)
+    {
+        if(!needs_split(node, depth)) return;
+        Obj obj;
+        obj.dist = -double(node->item_indices.size()) * node->bbox.delta().max_entry() / root_side; // min heap
+        obj.node = node;
+        q.push(obj);
+    };
+    std::vector<std::pair<TwseventreeNode*,uint>> nodes; // (node, depth), grows while visited
+    for(int i=0; i<27; ++i)
+    {
+        if(root->children[i]!=nullptr) nodes.push_back(std::make_pair(root->children[i], 2u));
+    }
+    for(size_t i=0; i<nodes.size(); ++i)
+    {
+        TwseventreeNode *node  = nodes.at(i).first;
+        uint             depth = nodes.at(i).second;
+        if(depth>lattice_levels)
+        {
+            push(node, depth);
+            continue;
+        }
+        subdivide(node);
+        for(int j=0; j<27; ++j)
+        {
+            if(node->children[j]!=nullptr) nodes.push_back(std::make_pair(node->children[j], depth+1));
+        }
+    }
 
-    node->children[24] = new TwseventreeNode(node, AABB(vec3d(min[0], avg2[1], avg2[2]), vec3d(avg1[0], max[1], max[2])));
-    node->children[25] = new TwseventreeNode(node, AABB(vec3d(avg1[0], avg2[1], avg2[2]), vec3d(avg2[0], max[1], max[2])));
-    node->children[26] = new TwseventreeNode(node, AABB(vec3d(avg2[0], avg2[1], avg2[2]), vec3d(max[0], max[1], max[2])));
+    size_t n_leaves    = 0;
+    predicted_cells    = predict_num_cells(&n_leaves);
+    prediction_passes  = 1;
+    double split_cost  = 26.0; // predicted cells added by one split, as observed in the last batch
+    size_t max_splits  = std::numeric_limits<size_t>::max();
+    while(!q.empty() && predicted_cells<cell_budget)
+    {
+        size_t splits = size_t(double(cell_budget-predicted_cells) / (2*split_cost));
+        splits = std::min(splits, n_leaves/26); // split cost grows with depth: at most double the leaves
+        splits = std::min(splits, max_splits);
+        splits = std::max(splits, size_t(1));
+
+        // checkpoint, to undo the batch if it exceeds the budget
+        PrioQueue q_backup = q;
+        size_t    implicit = implicit_leaves;
+        size_t    dropped  = dropped_cells;
+        size_t    rejected = exact_rejections;
+        size_t    allocs   = vector_allocs_estimate;
+        TwseventreeNodePool::Checkpoint  pool_mark  = pool.checkpoint();
+        TwseventreeIndexPool::Checkpoint index_mark = index_pool.checkpoint();
+        std::vector<std::pair<TwseventreeNode*,TwseventreeItemList>> batch;
+
+        for(size_t i=0; i<splits && !q.empty(); ++i)
+        {
+            TwseventreeNode *node = q.top().node;
+            q.pop();
+            uint depth = node_depth(node);
+            batch.push_back(std::make_pair(node, node->item_indices));
+            subdivide(node);
+            for(int j=0; j<27; ++j)
+            {
+                if(node->children[j]!=nullptr) push(node->children[j], depth+1);
+            }
+        }
 
+        size_t n = 0;
+        size_t p = predict_num_cells(&n);
+        ++prediction_passes;
 
-    for(uint it : node->item_indices)
-    {
-        bool orphan = true;
-        for(int i=0; i<27; ++i)
+        if(p>cell_budget)
         {
-            assert(node->children[i]!=nullptr);
-            if(node->children[i]->bbox.intersects_box(items.at(it)->aabb))
+            // the children of the batch, and their item lists, are the last allocations of the pools
+            for(auto it=batch.rbegin(); it!=batch.rend(); ++it)
             {
-                node->children[i]->item_indices.push_back(it);
-                orphan = false;
+                std::fill(it->first->children, it->first->children+27, nullptr);
+                it->first->is_inner     = false;
+                it->first->item_indices = it->second;
             }
+            pool.reset(pool_mark);
+            index_pool.reset(index_mark);
+            q               = q_backup;
+            implicit_leaves        = implicit;
+            dropped_cells          = dropped;
+            exact_rejections       = rejected;
+            vector_allocs_estimate = allocs;
+            if(batch.size()==1) break;
+            max_splits = batch.size()/2;
+            continue;
         }
-        assert(!orphan);
+
+        split_cost      = std::max(26.0, double(p-predicted_cells) / double(batch.size()));
+        predicted_cells = p;
+        n_leaves        = n;
+        max_splits      = std::numeric_limits<size_t>::max();
     }
 
-    node->item_indices.clear();
-    node->is_inner = true;
+    tree_depth = 1;
+    for_each_leaf([&](const AABB &, const TwseventreeNode *leaf, const uint depth)
+    {
+        if(leaf!=nullptr) leaves.push_back(leaf);
+        tree_depth = std::max(tree_depth, depth);
+    });
 }
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
 CINO_INLINE
-void Twseventree::push_point(const uint id, const vec3d & v)
+size_t Twseventree::predict_num_cells(size_t * n_leaves) const
 {
-    items.push_back(new Point(id,v));
-}
+    if(root==nullptr) return 0;
 
+    // leaves are identified by their depth and integer coordinates in the grid of that depth
+    struct Cell
+    {
+        uint    depth;
+        int64_t ijk[3];
+    };
+    auto key = [](const uint depth, const int64_t ijk[3]) -> uint64_t
+    {
+        return (uint64_t(depth)<<60) | (uint64_t(ijk[0])<<40) | (uint64_t(ijk[1])<<20) | uint64_t(ijk[2]);
+    };
 
-//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+    std::vector<Cell> cells;
+    std::vector<double> side(1, root->bbox.delta().max_entry());
+    for_each_leaf([&](const AABB & bbox, const TwseventreeNode *, const uint depth)
+    {
+        assert(depth<=13 && "27tree too deep for the cell count prediction");
+        while(side.size()<depth) side.push_back(side.back()/3.0);
+        Cell c;
+        c.depth = depth;
+        for(int i=0; i<3; ++i) c.ijk[i] = std::llround((bbox.min[i]-root->bbox.min[i]) / side.at(depth-1));
+        cells.push_back(c);
+    });
+
+    std::unordered_map<uint64_t,uint> index;
+    index.reserve(cells.size());
+    for(uint i=0; i<cells.size(); ++i) index[key(cells[i].depth, cells[i].ijk)] = i;
+
+    // every leaf looks for the (coarser or equal) leaves covering its 26 neighbor cells, and raises
+    // their finest neighbor depth. Any two touching leaves are found this way by the finer one
+    std::vector<uint> finest(cells.size());
+    for(uint i=0; i<cells.size(); ++i) finest[i] = cells[i].depth;
+    for(const Cell & c : cells)
+    {
+        int64_t n = 1; // cells per axis at this depth
+        for(uint d=1; d<c.depth; ++d) n *= 3;
 
-CINO_INLINE
+        for(int dz=-1; dz<=1; ++dz)
+        for(int dy=-1; dy<=1; ++dy)
+        for(int dx=-1; dx<=1; ++dx)
+        {
+            if(dx==0 && dy==0 && dz==0) continue;
+            int64_t nb[3] = { c.ijk[0]+dx, c.ijk[1]+dy, c.ijk[2]+dz };
+            if(nb[0]<0 || nb[1]<0 || nb[2]<0 || nb[0]>=n || nb[1]>=n || nb[2]>=n) continue;
+
+            for(uint d=c.depth; d>=1; --d)
+            {
+                auto it = index.find(key(d, nb));
+                if(it!=index.end())
+                {
+                    finest[it->second] = std::max(finest[it->second], c.depth);
+                    break;
+                }
+                for(int i=0; i<3; ++i) nb[i] /= 3;
+            }
+        }
+    }
+
+    size_t count = 0;
+    for(uint i=0; i<cells.size(); ++i) count += 1 + 26*(finest[i]-cells[i].depth);
+
+    if(n_leaves!=nullptr) *n_leaves = cells.size();
+    return count;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::place_root()
+{
+    TwseventreeNode *node = root;
+    vec3d min = node->bbox.min;
+    vec3d max = node->bbox.max;
+
+
+    if(lattice_base>0){
+        // already placed on the global lattice by anchor_root_to_lattice()
+    }
+    else if(root_brick){
+
+        // the brick is made of cubes of side D/3^L (D = longest side of the items box), with
+        // L as big as possible while cubes are not thinner than the thinnest side of the box.
+        // Cells at depth d have the same size of the padded cube case, but the root is anchored
+        // at the min corner, and its cells at depth <= L+1 falling beyond the brick are dropped
+        // (D is slightly inflated, so that no item touches the faces of the brick and ends up
+        // also in the cells beyond them when the box is an exact multiple of the cubes)
+        vec3d  delta = max - min;
+        double D     = delta.max_entry() * (1.0 + 1e-6);
+        double side  = D;
+        brick_levels = 0;
+        while(brick_levels+1 < max_depth && side/3.0 >= delta.min_entry())
+        {
+            side /= 3.0;
+            ++brick_levels;
+        }
+
+        uint n = 1; // cubes per side of the root
+        for(uint l=0; l<brick_levels; ++l) n *= 3;
+
+        vec3d brick_max;
+        for(int c=0; c<3; ++c)
+        {
+            brick_cubes[c] = std::max(1u, std::min(n, (uint)std::ceil(delta[c]/side)));
+            brick_max[c]   = (brick_cubes[c]==n) ? min[c] + D : min[c] + brick_cubes[c]*side;
+        }
+        node->bbox = AABB(min, min + vec3d(D,D,D));
+        brick      = AABB(min, brick_max);
+        brick_side = side;
+    }
+    else{
+
+        vec3d max_lato = (vec3d(abs(max.x() - min.x()), abs(max.y() - min.y()), abs(max.z() - min.z())));
+
+        double diff_x;
+        double diff_y;
+        double diff_z;
+
+        if(max_lato.x() > max_lato.y() && max_lato.x() > max_lato.z()){
+            diff_y = max_lato.x() - max_lato.y();
+            diff_z = max_lato.x() - max_lato.z();
+            node->bbox.push(vec3d(min.x(), min.y() - (diff_y/2),  min.z() - (diff_z/2)));
+            node->bbox.push(vec3d(max.x(), max.y() + (diff_y/2),  max.z() + (diff_z/2)));
+        }
+        else if(max_lato.y() > max_lato.x() && max_lato.y() > max_lato.z()){
+            diff_x = max_lato.y() - max_lato.x();
+            diff_z = max_lato.y() - max_lato.z();
+            node->bbox.push(vec3d(min.x() - (diff_x/2), min.y(), min.z() - (diff_z/2)));
+            node->bbox.push(vec3d(max.x() + (diff_x/2), max.y(), max.z() + (diff_z/2)));
+        }
+        else{
+            diff_x = max_lato.z() - max_lato.x();
+            diff_y = max_lato.z() - max_lato.y();
+            node->bbox.push(vec3d(min.x() - (diff_x/2),  min.y() - (diff_y/2), min.z()));
+            node->bbox.push(vec3d(max.x() + (diff_x/2),  max.y() + (diff_y/2), max.z()));
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::build_dense_levels(std::vector<std::pair<TwseventreeNode*,uint>> & seeds)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    place_root();
+
+    // levels are counted from the root (level l = depth l+1), and never go beyond max depth
+    uint k = std::min(dense_levels, max_depth + lattice_levels - 2);
+    dense_levels_built = k;
+
+    // 1) extent of the cells of each level along each axis, with the very same arithmetic of
+    //    subdivide(). The cells on the diagonal of a level span, along each axis, the intervals
+    //    of all its cells. Adjacent cells may not share bit-identical bounds (e.g. in anchored
+    //    trees), hence lower and upper bounds are stored separately
+    std::vector<std::array<std::vector<double>,3>> lo(k+1), hi(k+1);
+    for(int c=0; c<3; ++c)
+    {
+        lo[0][c] = { root->bbox.min[c] };
+        hi[0][c] = { root->bbox.max[c] };
+    }
+    for(uint l=0; l<k; ++l)
+    {
+        uint n = (uint)lo[l][0].size();
+        for(int c=0; c<3; ++c)
+        {
+            lo[l+1][c].resize(3*n);
+            hi[l+1][c].resize(3*n);
+        }
+        for(uint i=0; i<n; ++i)
+        {
+            double pl[3][4];
+            split_planes(AABB(vec3d(lo[l][0][i], lo[l][1][i], lo[l][2][i]),
+                              vec3d(hi[l][0][i], hi[l][1][i], hi[l][2][i])), pl);
+            for(int c=0; c<3; ++c)
+            for(int p=0; p<3; ++p)
+            {
+                lo[l+1][c][3*i+p] = pl[c][p];
+                hi[l+1][c][3*i+p] = pl[c][p+1];
+            }
+        }
+    }
+
+    std::vector<uint>   side(k+1, 1); // cells per axis of each level
+    std::vector<size_t> off (k+2, 0); // first cell of each level in the flat per cell arrays
+    for(uint l=1; l<=k; ++l)
+    {
+        side[l]  = 3*side[l-1];
+        off[l+1] = off[l] + size_t(side[l])*side[l]*side[l];
+    }
+    auto cell_id = [&](const uint l, const uint x, const uint y, const uint z) -> size_t
+    {
+        return off[l] + x + size_t(side[l])*(y + size_t(side[l])*z);
+    };
+
+    // 2) conservative voxelization: the cells of each level overlapped by the AABB of an item
+    //    are a box of cells, refined level by level within the range of the parent level exactly
+    //    as child_range_masks() does in the recursive build (closed boxes)
+    uint n_items = num_items();
+    auto for_each_cell = [&](const uint it, const std::function<void(const size_t cell)> & f)
+    {
+        AABB b = item_aabb(it);
+        uint first[3] = { 0, 0, 0 };
+        uint last [3] = { 0, 0, 0 };
+        for(uint l=1; l<=k; ++l)
+        {
+            for(int c=0; c<3; ++c)
+            {
+                const std::vector<double> & L = lo[l][c];
+                const std::vector<double> & H = hi[l][c];
+                first[c] = 3*first[c] + (b.min[c] >  H[3*first[c]]) + (b.min[c] >  H[3*first[c]+1]);
+                last [c] = 3*last [c] + (b.max[c] >= L[3*last [c]+1]) + (b.max[c] >= L[3*last [c]+2]);
+            }
+            for(uint z=first[2]; z<=last[2]; ++z)
+            for(uint y=first[1]; y<=last[1]; ++y)
+            for(uint x=first[0]; x<=last[0]; ++x) f(cell_id(l,x,y,z));
+        }
+    };
+
+    std::vector<std::atomic<uint>> count(off[k+1]);
+    PARALLEL_FOR(0, n_items, 1000, [&](uint it)
+    {
+        for_each_cell(it, [&](const size_t cell){ count[cell].fetch_add(1, std::memory_order_relaxed); });
+    });
+
+    // 3) top down allocation of the nodes of the dense levels. A cell splits under the same
+    //    conditions of needs_split(), and only its occupied children are allocated. Cells
+    //    that do not split, and all the occupied cells of the last level, are the frontier
+    std::vector<TwseventreeNode*> nodes(off[k+1], nullptr);
+    std::vector<int>              frontier(off[k+1], -1);
+    std::vector<TwseventreeNode*> frontier_nodes;
+    auto splits = [&](const uint n, const uint depth)
+    {
+        return depth<=lattice_levels || (depth<max_depth+lattice_levels && n>items_per_leaf);
+    };
+
+    root->is_inner = true;
+    dense_occupied = 0;
+    for(uint l=1; l<=k; ++l)
+    {
+        uint np = side[l-1];
+        for(uint pz=0; pz<np; ++pz)
+        for(uint py=0; py<np; ++py)
+        for(uint px=0; px<np; ++px)
+        {
+            TwseventreeNode *parent = (l==1) ? root : nodes[cell_id(l-1,px,py,pz)];
+            if(parent==nullptr || !parent->is_inner) continue;
+
+            AABB bboxes[27];
+            uint ids[27];
+            uint n = 0;
+            for(uint i=0; i<27; ++i)
+            {
+                uint x = 3*px + i%3, y = 3*py + (i/3)%3, z = 3*pz + i/9;
+                AABB bbox(vec3d(lo[l][0][x], lo[l][1][y], lo[l][2][z]),
+                          vec3d(hi[l][0][x], hi[l][1][y], hi[l][2][z]));
+                if(count[cell_id(l,x,y,z)]==0)
+                {
+                    if(in_root_brick(bbox)) implicit_leaves.fetch_add(1, std::memory_order_relaxed);
+                    else                    dropped_cells.fetch_add  (1, std::memory_order_relaxed);
+                    continue;
+                }
+                bboxes[n] = bbox;
+                ids[n++]  = i;
+            }
+
+            TwseventreeNode *block = (n>0) ? pool.alloc(parent, bboxes, n) : nullptr;
+            for(uint j=0; j<n; ++j)
+            {
+                uint   i    = ids[j];
+                size_t cell = cell_id(l, 3*px + i%3, 3*py + (i/3)%3, 3*pz + i/9);
+                TwseventreeNode *child = block + j;
+                parent->children[i] = child;
+                nodes[cell]         = child;
+                if(l<k && splits(count[cell], l+1)) child->is_inner = true;
+                else
+                {
+                    frontier[cell] = (int)frontier_nodes.size();
+                    frontier_nodes.push_back(child);
+                    seeds.push_back(std::make_pair(child, l+1));
+                }
+                if(l==k) ++dense_occupied;
+            }
+        }
+    }
+    root->item_indices.clear();
+
+    // 4) item lists of the frontier, sorted as in the recursive build (which preserves input order)
+    std::vector<std::atomic<uint>> fill(frontier_nodes.size());
+    PARALLEL_FOR(0, n_items, 1000, [&](uint it)
+    {
+        for_each_cell(it, [&](const size_t cell)
+        {
+            if(frontier[cell]>=0) fill[frontier[cell]].fetch_add(1, std::memory_order_relaxed);
+        });
+    });
+    std::vector<uint> begin(frontier_nodes.size()+1, 0);
+    for(uint i=0; i<frontier_nodes.size(); ++i)
+    {
+        begin[i+1] = begin[i] + fill[i].load();
+        fill[i]    = begin[i];
+    }
+    uint *block = index_pool.alloc(begin.back());
+    PARALLEL_FOR(0, n_items, 1000, [&](uint it)
+    {
+        for_each_cell(it, [&](const size_t cell)
+        {
+            if(frontier[cell]>=0) block[fill[frontier[cell]].fetch_add(1, std::memory_order_relaxed)] = it;
+        });
+    });
+    PARALLEL_FOR(0, (uint)frontier_nodes.size(), 100, [&](uint i)
+    {
+        std::sort(block + begin[i], block + begin[i+1]);
+        frontier_nodes[i]->item_indices.ptr   = block + begin[i];
+        frontier_nodes[i]->item_indices.count = begin[i+1] - begin[i];
+    });
+
+    dense_time = how_many_seconds(t0, Time::now());
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::subdivide(TwseventreeNode * node)
+{
+    // create children octants
+    if(this->root == node) place_root();
+
+    uint  begin[28];
+    uint *lists = distribute_items(node, begin);
+
+    // only children that received items are allocated, as a single contiguous block.
+    // Empty children stay nullptr, and become leaves only when the tree is visited
+    AABB bboxes[27];
+    uint ids[27];
+    uint n = 0;
+    for(uint i=0; i<27; ++i)
+    {
+        if(begin[i+1]==begin[i]) continue;
+        bboxes[n] = child_bbox(node, i);
+        ids[n++]  = i;
+    }
+    for(uint i=0, j=0; i<27; ++i)
+    {
+        if(j<n && ids[j]==i) { ++j; continue; }
+        if(in_root_brick(child_bbox(node,i))) implicit_leaves.fetch_add(1, std::memory_order_relaxed);
+        else                                  dropped_cells.fetch_add  (1, std::memory_order_relaxed);
+    }
+
+    TwseventreeNode *block = (n>0) ? pool.alloc(node, bboxes, n) : nullptr;
+    for(uint j=0; j<n; ++j)
+    {
+        TwseventreeNode *child     = block + j;
+        child->item_indices.ptr    = lists + begin[ids[j]];
+        child->item_indices.count  = begin[ids[j]+1] - begin[ids[j]];
+        node->children[ids[j]]     = child;
+    }
+
+    node->item_indices.clear();
+    node->is_inner = true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::split_planes(const AABB & cell, double planes[3][4]) const
+{
+    if(lattice_base<=0)
+    {
+        // the split arithmetic and the child numbering are the ones of SpatialTreeLayout<3>
+        double bmin[3] = { cell.min[0], cell.min[1], cell.min[2] };
+        double bmax[3] = { cell.max[0], cell.max[1], cell.max[2] };
+        SpatialTreeLayout<3>::split_planes(bmin, bmax, planes);
+        return;
+    }
+
+    // anchored tree: planes are origin + (integer coordinate) * (lattice spacing of the children).
+    // The integer coordinates of the cell are recovered by rounding, so that planes never depend
+    // on the path from the root, which changes with the extent of the items
+    double h = cell.delta().max_entry();
+    for(int c=0; c<3; ++c)
+    {
+        double o = lattice_origin[c];
+        if(h > 1.5*lattice_base)
+        {
+            // coarser than base: the children are made of step x step x step base cells
+            int64_t step = std::llround(h/lattice_base) / 3;
+            int64_t i0   = std::llround((cell.min[c]-o)/lattice_base);
+            for(int p=0; p<4; ++p) planes[c][p] = o + double(i0 + p*step) * lattice_base;
+        }
+        else
+        {
+            // base cell or finer, of side base/r (r = 3^j)
+            double  r  = std::max(1.0, (double)std::llround(lattice_base/h));
+            double  hc = lattice_base / (3*r);
+            int64_t i0 = std::llround((cell.min[c]-o) / (lattice_base/r));
+            for(int p=0; p<4; ++p) planes[c][p] = o + double(3*i0 + p) * hc;
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::anchor_root_to_lattice()
+{
+    // smallest cube of 3^k base cells with a corner on the lattice covering the items,
+    // and the brick of the base cells actually touched by them
+    int64_t lo[3], cells[3], side = 1;
+    for(int c=0; c<3; ++c)
+    {
+        lo[c]       = (int64_t)std::floor((root->bbox.min[c] - lattice_origin[c]) / lattice_base);
+        int64_t hi  = (int64_t)std::floor((root->bbox.max[c] - lattice_origin[c]) / lattice_base);
+        cells[c]    = hi - lo[c] + 1;
+    }
+    lattice_levels = 0;
+    while(side < std::max(cells[0], std::max(cells[1], cells[2])))
+    {
+        side *= 3;
+        ++lattice_levels;
+    }
+
+    vec3d rmin, rmax, bmax;
+    for(int c=0; c<3; ++c)
+    {
+        rmin[c] = lattice_origin[c] + double(lo[c])            * lattice_base;
+        rmax[c] = lattice_origin[c] + double(lo[c] + side)     * lattice_base;
+        bmax[c] = lattice_origin[c] + double(lo[c] + cells[c]) * lattice_base;
+        brick_cubes[c] = (uint)cells[c];
+    }
+    root->bbox   = AABB(rmin, rmax);
+    brick        = AABB(rmin, bmax);
+    brick_side   = lattice_base;
+    brick_levels = lattice_levels;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+AABB Twseventree::child_bbox(const AABB & cell, const uint i) const
+{
+    double planes[3][4], cmin[3], cmax[3];
+    split_planes(cell, planes);
+    SpatialTreeLayout<3>::child_bbox(planes, i, cmin, cmax);
+    return AABB(vec3d(cmin[0], cmin[1], cmin[2]), vec3d(cmax[0], cmax[1], cmax[2]));
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool Twseventree::in_root_brick(const AABB & cell) const
+{
+    // only cells entirely beyond the brick are dropped: coarser cells that straddle one of its
+    // faces are kept, as part of them may be inside the part. Cell corners and brick faces are
+    // on the lattice of the cell (or of the brick cubes, if finer), hence half of its spacing
+    // absorbs all roundoff
+    if(!root_brick && lattice_base<=0) return true;
+    for(int c=0; c<3; ++c)
+    {
+        double tol = 0.5 * std::min(cell.delta()[c], brick_side);
+        if(cell.min[c] > brick.max[c] - tol) return false;
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::for_each_leaf(const std::function<void(const AABB & bbox, const TwseventreeNode *leaf, const uint depth)> & f) const
+{
+    if(root==nullptr) return;
+
+    std::function<void(const AABB&,const uint)> visit_implicit = [&](const AABB & bbox, const uint depth)
+    {
+        if(!in_root_brick(bbox)) return;
+        if(depth<=lattice_levels)
+        {
+            for(uint i=0; i<27; ++i) visit_implicit(child_bbox(bbox,i), depth+1);
+        }
+        else f(bbox, nullptr, depth);
+    };
+
+    std::function<void(const TwseventreeNode*,const uint)> visit = [&](const TwseventreeNode *node, const uint depth)
+    {
+        if(!node->is_inner)
+        {
+            f(node->bbox, node, depth);
+            return;
+        }
+        for(uint i=0; i<27; ++i)
+        {
+            if(node->children[i]!=nullptr) visit(node->children[i], depth+1);
+            else                           visit_implicit(child_bbox(node,i), depth+1);
+        }
+    };
+    visit(root, 1);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::add_leaf(const TwseventreeNode * leaf)
+{
+    leaf_slot[leaf] = (uint)leaves.size();
+    leaves.push_back(leaf);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::remove_leaf(const TwseventreeNode * leaf)
+{
+    // swap with the last leaf, so that removals do not shift the whole vector
+    auto it = leaf_slot.find(leaf);
+    assert(it!=leaf_slot.end());
+    uint slot = it->second;
+    leaf_slot.erase(it);
+    if(slot+1<leaves.size())
+    {
+        leaves.at(slot) = leaves.back();
+        leaf_slot[leaves.at(slot)] = slot;
+    }
+    leaves.pop_back();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::split_edited_leaves(std::vector<std::pair<TwseventreeNode*,uint>> & todo)
+{
+    while(!todo.empty())
+    {
+        TwseventreeNode *node  = todo.back().first;
+        uint             depth = todo.back().second;
+        todo.pop_back();
+
+        edited_leaves.push_back(node);
+        if(!needs_split(node, depth)) continue;
+
+        remove_leaf(node);
+        subdivide(node);
+        tree_depth = std::max(tree_depth, depth+1);
+        for(int i=0; i<27; ++i)
+        {
+            if(node->children[i]==nullptr) continue;
+            add_leaf(node->children[i]);
+            todo.push_back(std::make_pair(node->children[i], depth+1));
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::finish_edit()
+{
+    std::sort(edited_leaves.begin(), edited_leaves.end());
+    edited_leaves.erase(std::unique(edited_leaves.begin(), edited_leaves.end()), edited_leaves.end());
+    edited_leaves.erase(std::remove_if(edited_leaves.begin(), edited_leaves.end(),
+                                       [&](const TwseventreeNode *n){ return leaf_slot.count(n)==0; }),
+                        edited_leaves.end());
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::begin_edit()
+{
+    assert(root!=nullptr && "edits apply to a built tree");
+    edited_leaves.clear();
+    csr_stale = true;
+    if(leaf_slot.size()!=leaves.size())
+    {
+        leaf_slot.clear();
+        for(uint i=0; i<leaves.size(); ++i) leaf_slot[leaves.at(i)] = i;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::find_item_leaves(const uint it, const bool allocate, std::vector<TwseventreeNode*> & out)
+{
+    // same classification of the build. Empty children on the way are either
+    // skipped or allocated as new leaves, which stop being implicit leaves
+    out.clear();
+    if(!root->bbox.intersects_box(item_aabb(it))) return;
+    std::vector<TwseventreeNode*> stack(1, root);
+    while(!stack.empty())
+    {
+        TwseventreeNode *node = stack.back();
+        stack.pop_back();
+        if(!node->is_inner)
+        {
+            out.push_back(node);
+            continue;
+        }
+        uint32_t mask = child_mask(node, it);
+        for(uint i=0; i<27; ++i)
+        {
+            if(!(mask & (1u<<i))) continue;
+            if(node->children[i]==nullptr)
+            {
+                if(!allocate) continue;
+                AABB bbox = child_bbox(node, i);
+                if(in_root_brick(bbox)) --implicit_leaves;
+                else                    --dropped_cells;
+                node->children[i] = pool.alloc(node, &bbox, 1);
+                add_leaf(node->children[i]);
+            }
+            stack.push_back(node->children[i]);
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::add_items(ItemsOfLeaf & added)
+{
+    // each leaf gets a new list, merging the sorted old and new items,
+    // then leaves split as build() would split them
+    std::vector<std::pair<TwseventreeNode*,uint>> todo;
+    for(auto & a : added)
+    {
+        TwseventreeNode *leaf = a.first;
+        std::sort(a.second.begin(), a.second.end());
+        uint *list = index_pool.alloc(leaf->item_indices.size() + a.second.size());
+        uint *end  = std::merge(leaf->item_indices.begin(), leaf->item_indices.end(), a.second.begin(), a.second.end(), list);
+        leaf->item_indices.ptr   = list;
+        leaf->item_indices.count = (uint)(end - list);
+        todo.push_back(std::make_pair(leaf, node_depth(leaf)));
+    }
+    split_edited_leaves(todo);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::remove_items(ItemsOfLeaf & removed)
+{
+    // lists of different leaves never overlap, hence items are removed in place
+    for(auto & r : removed)
+    {
+        TwseventreeNode *leaf = r.first;
+        std::sort(r.second.begin(), r.second.end());
+        uint *end = std::remove_if(leaf->item_indices.begin(), leaf->item_indices.end(),
+                                   [&](const uint it){ return std::binary_search(r.second.begin(), r.second.end(), it); });
+        leaf->item_indices.count = (uint)(end - leaf->item_indices.begin());
+        edited_leaves.push_back(leaf);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::collapse_fathers(const std::vector<const TwseventreeNode*> & nodes)
+{
+    // collapse bottom up the inner nodes made only of leaves that would not split them any more.
+    // Fathers are const to protect the tree from its users, but the tree owns them
+    std::priority_queue<std::pair<uint,TwseventreeNode*>> fathers; // deepest first
+    for(const TwseventreeNode *node : nodes)
+    {
+        if(node->father!=nullptr) fathers.push(std::make_pair(node_depth(node)-1, const_cast<TwseventreeNode*>(node->father)));
+    }
+
+    std::vector<uint> merged;
+    while(!fathers.empty())
+    {
+        uint             depth = fathers.top().first;
+        TwseventreeNode *node  = fathers.top().second;
+        fathers.pop();
+        if(!node->is_inner) continue; // already collapsed
+
+        merged.clear();
+        bool all_leaves = true;
+        for(int i=0; i<27 && all_leaves; ++i)
+        {
+            const TwseventreeNode *child = node->children[i];
+            if(child==nullptr) continue;
+            if(child->is_inner) all_leaves = false;
+            else merged.insert(merged.end(), child->item_indices.begin(), child->item_indices.end());
+        }
+        if(!all_leaves) continue;
+        std::sort(merged.begin(), merged.end());
+        merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+
+        node->item_indices.ptr   = merged.data();
+        node->item_indices.count = (uint)merged.size();
+        bool split = needs_split(node, depth);
+        node->item_indices.clear();
+        if(split) continue;
+
+        for(int i=0; i<27; ++i)
+        {
+            if(node->children[i]==nullptr)
+            {
+                if(in_root_brick(child_bbox(node,i))) --implicit_leaves;
+                else                                  --dropped_cells;
+            }
+            else remove_leaf(node->children[i]);
+            node->children[i] = nullptr;
+        }
+        if(!merged.empty())
+        {
+            node->item_indices.ptr   = index_pool.alloc(merged.size());
+            node->item_indices.count = (uint)merged.size();
+            std::copy(merged.begin(), merged.end(), node->item_indices.begin());
+        }
+        node->is_inner = false;
+        add_leaf(node);
+        edited_leaves.push_back(node);
+        if(node->father!=nullptr) fathers.push(std::make_pair(depth-1, const_cast<TwseventreeNode*>(node->father)));
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+const std::vector<const TwseventreeNode*> & Twseventree::insert_triangles(const std::vector<vec3d> & verts,
+                                                                          const std::vector<uint>  & tris,
+                                                                          const std::vector<uint>  & ids)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    assert(tris.size()==3*ids.size());
+    begin_edit();
+
+    uint first = num_items();
+    for(uint i=0; i<ids.size(); ++i)
+    {
+        push_triangle(ids.at(i), verts.at(tris.at(3*i)), verts.at(tris.at(3*i+1)), verts.at(tris.at(3*i+2)));
+    }
+    init_refinement_criteria(first);
+    if(id_items_ready)
+    {
+        for(uint it=first; it<num_items(); ++it) id_items.emplace(item_id(it), it);
+    }
+
+    ItemsOfLeaf added;
+    std::vector<TwseventreeNode*> item_leaves;
+    for(uint it=first; it<num_items(); ++it)
+    {
+        find_item_leaves(it, true, item_leaves);
+        for(TwseventreeNode *leaf : item_leaves) added[leaf].push_back(it);
+    }
+    add_items(added);
+    finish_edit();
+
+    if(print_debug_info)
+    {
+        std::cout << "27tree edit: " << ids.size() << " triangles inserted, " << edited_leaves.size() << " leaves changed ("
+                  << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+    return edited_leaves;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+const std::vector<const TwseventreeNode*> & Twseventree::remove_triangles(const std::vector<uint> & ids)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    begin_edit();
+    if(!id_items_ready)
+    {
+        id_items.reserve(num_items());
+        for(uint it=0; it<num_items(); ++it) id_items.emplace(item_id(it), it);
+        id_items_ready = true;
+    }
+    removed_items.resize(num_items(), false);
+
+    ItemsOfLeaf removed;
+    std::vector<TwseventreeNode*> item_leaves;
+    size_t n_removed = 0;
+    for(uint id : ids)
+    {
+        auto range = id_items.equal_range(id);
+        for(auto it=range.first; it!=range.second; ++it)
+        {
+            find_item_leaves(it->second, false, item_leaves);
+            for(TwseventreeNode *leaf : item_leaves) removed[leaf].push_back(it->second);
+            removed_items[it->second] = true;
+            ++n_removed;
+        }
+        id_items.erase(range.first, range.second);
+    }
+    remove_items(removed);
+    collapse_fathers(edited_leaves);
+    finish_edit();
+
+    if(print_debug_info)
+    {
+        std::cout << "27tree edit: " << n_removed << " items removed, " << edited_leaves.size() << " leaves changed ("
+                  << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+    return edited_leaves;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+const std::vector<const TwseventreeNode*> & Twseventree::refit(const std::vector<vec3d> & verts,
+                                                               const std::vector<uint>  & tris)
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    assert(tris.size()==3*size_t(num_items()));
+    begin_edit();
+    removed_items.resize(num_items(), false);
+
+    auto vert = [&](const uint it, const uint k) -> vec3d
+    {
+        if(triangle_soa) return soa_tris.vert(it,k);
+        assert(items.at(it)->item_type()==TRIANGLE && "refit() supports triangles only");
+        return static_cast<const Triangle*>(items.at(it))->v[k];
+    };
+
+    // items that moved, and the leaves that hold them before the deformation
+    std::vector<uint> moved;
+    for(uint it=0; it<num_items(); ++it)
+    {
+        if(removed_items[it]) continue;
+        for(uint k=0; k<3; ++k)
+        {
+            if(!(vert(it,k)==verts.at(tris.at(3*it+k)))) { moved.push_back(it); break; }
+        }
+    }
+    std::vector<std::vector<TwseventreeNode*>> old_leaves(moved.size());
+    for(uint i=0; i<moved.size(); ++i)
+    {
+        find_item_leaves(moved.at(i), false, old_leaves.at(i));
+        std::sort(old_leaves.at(i).begin(), old_leaves.at(i).end());
+    }
+
+    // new geometry (and per item data of the refinement criteria)
+    for(uint it : moved)
+    {
+        vec3d v[3] = { verts.at(tris.at(3*it)), verts.at(tris.at(3*it+1)), verts.at(tris.at(3*it+2)) };
+        if(triangle_soa) soa_tris.set(it, soa_tris.ids.at(it), v[0], v[1], v[2]);
+        else
+        {
+            uint id = items.at(it)->id;
+            delete items.at(it);
+            items.at(it) = new Triangle(id, v);
+        }
+    }
+    update_refinement_criteria(moved);
+
+    // items move only between the leaves they leave and the leaves they enter. With sizing or
+    // normal criteria the leaves they stay in are also checked, as their items have changed
+    ItemsOfLeaf removed, added;
+    std::vector<TwseventreeNode*> new_leaves, stayed;
+    for(uint i=0; i<moved.size(); ++i)
+    {
+        uint it = moved.at(i);
+        const std::vector<TwseventreeNode*> & old_l = old_leaves.at(i);
+        find_item_leaves(it, true, new_leaves);
+        std::sort(new_leaves.begin(), new_leaves.end());
+        for(TwseventreeNode *leaf : old_l)
+        {
+            if(!std::binary_search(new_leaves.begin(), new_leaves.end(), leaf)) removed[leaf].push_back(it);
+            else stayed.push_back(leaf);
+        }
+        for(TwseventreeNode *leaf : new_leaves)
+        {
+            if(!std::binary_search(old_l.begin(), old_l.end(), leaf)) added[leaf].push_back(it);
+        }
+    }
+    remove_items(removed);
+    std::vector<const TwseventreeNode*> emptied(edited_leaves);
+    if(sizing_field || max_normal_deviation>0)
+    {
+        std::sort(stayed.begin(), stayed.end());
+        stayed.erase(std::unique(stayed.begin(), stayed.end()), stayed.end());
+        for(TwseventreeNode *leaf : stayed)
+        {
+            added[leaf]; // no new items, but checked for split
+            emptied.push_back(leaf);
+        }
+    }
+    add_items(added);
+    collapse_fathers(emptied);
+    finish_edit();
+
+    if(print_debug_info)
+    {
+        std::cout << "27tree refit: " << moved.size() << " items moved, " << edited_leaves.size() << " leaves changed ("
+                  << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+    return edited_leaves;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+vec3d Twseventree::item_closest_point(const uint it, const vec3d & p) const
+{
+    if(!triangle_soa) return items.at(it)->point_closest_to(p);
+    vec3d v[3] = { soa_tris.vert(it,0), soa_tris.vert(it,1), soa_tris.vert(it,2) };
+    return Triangle(soa_tris.ids.at(it), v).point_closest_to(p);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+vec3d Twseventree::closest_point(const vec3d & p) const
+{
+    uint   id;
+    vec3d  pos;
+    double dist;
+    closest_point(p, id, pos, dist);
+    return pos;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::closest_point(const vec3d & p, uint & id, vec3d & pos, double & dist) const
+{
+    std::vector<uint>   ids;
+    std::vector<vec3d>  all_pos;
+    std::vector<double> all_dist;
+    k_nearest(p, 1, ids, all_pos, all_dist);
+    assert(!ids.empty() && "closest_point() on an empty tree");
+    id   = ids.front();
+    pos  = all_pos.front();
+    dist = all_dist.front();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::k_nearest(const vec3d & p, const uint k, std::vector<uint> & ids, std::vector<vec3d> & pos, std::vector<double> & dist) const
+{
+    ids.clear();
+    pos.clear();
+    dist.clear();
+    if(root==nullptr || k==0) return;
+
+    // nodes are queued with the distance of their box, which bounds the distance of all their
+    // items from below: an item popped from the queue is closer than anything still in it.
+    // Queries never modify the nodes, the cast only serves the type of Obj
+    std::vector<uint> found; // storage indices of the items already reported
+    double bound = inf_double; // k==1: closest item queued so far, farther nodes and items are useless
+    PrioQueue q;
+    Obj obj;
+    obj.node = const_cast<TwseventreeNode*>(root);
+    obj.dist = root->bbox.dist_sqrd(p);
+    q.push(obj);
+
+    while(!q.empty() && ids.size()<k)
+    {
+        Obj top = q.top();
+        q.pop();
+
+        if(top.index>=0)
+        {
+            if(std::find(found.begin(), found.end(), (uint)top.index)!=found.end()) continue; // also in another leaf
+            found.push_back(top.index);
+            ids.push_back(item_id(top.index));
+            pos.push_back(top.pos);
+            dist.push_back(std::sqrt(top.dist));
+        }
+        else if(top.node->is_inner)
+        {
+            for(int i=0; i<27; ++i)
+            {
+                const TwseventreeNode *child = top.node->children[i];
+                if(child==nullptr) continue;
+                Obj c;
+                c.node = const_cast<TwseventreeNode*>(child);
+                c.dist = child->bbox.dist_sqrd(p);
+                if(c.dist<=bound) q.push(c);
+            }
+        }
+        else
+        {
+            for(uint it : top.node->item_indices)
+            {
+                Obj c;
+                c.node  = top.node;
+                c.index = (int)it;
+                c.pos   = item_closest_point(it, p);
+                c.dist  = c.pos.dist_squared(p);
+                if(std::isnan(c.dist) || c.dist>bound) continue; // (degenerate items would break the ordering of the queue)
+                if(k==1) bound = c.dist;
+                q.push(c);
+            }
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::closest_points(const std::vector<vec3d> & p, std::vector<uint> & ids, std::vector<vec3d> & pos, std::vector<double> & dist) const
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    ids.resize(p.size());
+    pos.resize(p.size());
+    dist.resize(p.size());
+    PARALLEL_FOR(0, (uint)p.size(), 64, [&](uint i)
+    {
+        closest_point(p.at(i), ids.at(i), pos.at(i), dist.at(i));
+    });
+
+    if(print_debug_info)
+    {
+        std::cout << "27tree closest points: " << p.size() << " queries (" << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::query_leaves(const AABB & box, TwseventreeQueryContext & ctx) const
+{
+    ctx.begin(num_items());
+    if(root==nullptr || !root->bbox.intersects_box(box)) return;
+
+    ctx.stack.push_back(root);
+    while(!ctx.stack.empty())
+    {
+        const TwseventreeNode *node = ctx.stack.back();
+        ctx.stack.pop_back();
+        if(!node->is_inner)
+        {
+            ctx.leaves.push_back(node);
+            continue;
+        }
+        for(int i=0; i<27; ++i)
+        {
+            const TwseventreeNode *child = node->children[i];
+            if(child!=nullptr && child->bbox.intersects_box(box)) ctx.stack.push_back(child);
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::query_box(const AABB & box, TwseventreeQueryContext & ctx) const
+{
+    query_leaves(box, ctx);
+    for(const TwseventreeNode *leaf : ctx.leaves)
+    {
+        for(uint it : leaf->item_indices)
+        {
+            if(ctx.stamps[it]==ctx.stamp) continue;
+            ctx.stamps[it] = ctx.stamp;
+            if(item_aabb(it).intersects_box(box)) ctx.ids.push_back(item_id(it));
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::query_sphere(const vec3d & c, const double r, TwseventreeQueryContext & ctx) const
+{
+    ctx.begin(num_items());
+    double r2 = r*r;
+    if(root==nullptr || root->bbox.dist_sqrd(c)>r2) return;
+
+    ctx.stack.push_back(root);
+    while(!ctx.stack.empty())
+    {
+        const TwseventreeNode *node = ctx.stack.back();
+        ctx.stack.pop_back();
+        if(node->is_inner)
+        {
+            for(int i=0; i<27; ++i)
+            {
+                const TwseventreeNode *child = node->children[i];
+                if(child!=nullptr && child->bbox.dist_sqrd(c)<=r2) ctx.stack.push_back(child);
+            }
+            continue;
+        }
+        ctx.leaves.push_back(node);
+        for(uint it : node->item_indices)
+        {
+            if(ctx.stamps[it]==ctx.stamp) continue;
+            ctx.stamps[it] = ctx.stamp;
+            // the AABB test skips most of the exact distances
+            if(item_aabb(it).dist_sqrd(c)<=r2 && item_closest_point(it,c).dist_squared(c)<=r2) ctx.ids.push_back(item_id(it));
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool Twseventree::item_ray_hit(const uint it, const vec3d & p, const vec3d & dir, double & t) const
+{
+    if(triangle_soa) return ray_triangle_hit(p, dir, soa_tris.vert(it,0), soa_tris.vert(it,1), soa_tris.vert(it,2), t);
+    const SpatialDataStructureItem *item = items.at(it);
+    if(item->item_type()==TRIANGLE)
+    {
+        const Triangle *tri = static_cast<const Triangle*>(item);
+        return ray_triangle_hit(p, dir, tri->v[0], tri->v[1], tri->v[2], t);
+    }
+    vec3d pos;
+    return item->intersects_ray(p, dir, t, pos);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool Twseventree::clip_ray(const AABB & box, const vec3d & p, const vec3d & dir, const vec3d & inv, double & t0, double & t1)
+{
+    for(int c=0; c<3; ++c)
+    {
+        if(dir[c]==0)
+        {
+            if(p[c]<box.min[c] || p[c]>box.max[c]) return false;
+            continue;
+        }
+        double ta = (box.min[c] - p[c]) * inv[c];
+        double tb = (box.max[c] - p[c]) * inv[c];
+        if(ta>tb) std::swap(ta,tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+        if(t0>t1) return false;
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint32_t Twseventree::clip_ray_packet(const AABB & box, const RayPacket & rp, double * t0, double * t1)
+{
+    // slab test of several lanes at once, one per SIMD lane. Lanes parallel to an axis keep their
+    // interval if their origin lies within the slab and get an empty one otherwise, as in clip_ray,
+    // so that the interval of a lane crossing the box is the very same computed by clip_ray
+    // (min/max operands are in the order that picks the same value of std::swap/max/min)
+    uint32_t mask = 0;
+    uint     l    = 0;
+
+#if defined(__AVX__)
+    const __m256d pinf = _mm256_set1_pd( inf_double);
+    const __m256d ninf = _mm256_set1_pd(-inf_double);
+    const __m256d zero = _mm256_setzero_pd();
+    for(; l+4<=ray_packet_size; l+=4)
+    {
+        __m256d a = _mm256_loadu_pd(t0+l);
+        __m256d b = _mm256_loadu_pd(t1+l);
+        for(int c=0; c<3; ++c)
+        {
+            __m256d o    = _mm256_loadu_pd(rp.o  [c]+l);
+            __m256d d    = _mm256_loadu_pd(rp.d  [c]+l);
+            __m256d inv  = _mm256_loadu_pd(rp.inv[c]+l);
+            __m256d lo   = _mm256_set1_pd(box.min[c]);
+            __m256d hi   = _mm256_set1_pd(box.max[c]);
+            __m256d ta   = _mm256_mul_pd(_mm256_sub_pd(lo, o), inv);
+            __m256d tb   = _mm256_mul_pd(_mm256_sub_pd(hi, o), inv);
+            __m256d par  = _mm256_cmp_pd(d, zero, _CMP_EQ_OQ);
+            __m256d in   = _mm256_and_pd(_mm256_cmp_pd(o, lo, _CMP_GE_OQ), _mm256_cmp_pd(o, hi, _CMP_LE_OQ));
+            __m256d tmin = _mm256_blendv_pd(_mm256_min_pd(tb, ta), _mm256_blendv_pd(pinf, ninf, in), par);
+            __m256d tmax = _mm256_blendv_pd(_mm256_max_pd(ta, tb), _mm256_blendv_pd(ninf, pinf, in), par);
+            a = _mm256_max_pd(tmin, a);
+            b = _mm256_min_pd(tmax, b);
+        }
+        _mm256_storeu_pd(t0+l, a);
+        _mm256_storeu_pd(t1+l, b);
+        mask |= (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ)) << l;
+    }
+#elif defined(__SSE2__)
+    const __m128d pinf = _mm_set1_pd( inf_double);
+    const __m128d ninf = _mm_set1_pd(-inf_double);
+    const __m128d zero = _mm_setzero_pd();
+    auto select = [](const __m128d m, const __m128d x, const __m128d y) { return _mm_or_pd(_mm_and_pd(m, x), _mm_andnot_pd(m, y)); }; // m ? x : y
+    for(; l+2<=ray_packet_size; l+=2)
+    {
+        __m128d a = _mm_loadu_pd(t0+l);
+        __m128d b = _mm_loadu_pd(t1+l);
+        for(int c=0; c<3; ++c)
+        {
+            __m128d o    = _mm_loadu_pd(rp.o  [c]+l);
+            __m128d d    = _mm_loadu_pd(rp.d  [c]+l);
+            __m128d inv  = _mm_loadu_pd(rp.inv[c]+l);
+            __m128d lo   = _mm_set1_pd(box.min[c]);
+            __m128d hi   = _mm_set1_pd(box.max[c]);
+            __m128d ta   = _mm_mul_pd(_mm_sub_pd(lo, o), inv);
+            __m128d tb   = _mm_mul_pd(_mm_sub_pd(hi, o), inv);
+            __m128d par  = _mm_cmpeq_pd(d, zero);
+            __m128d in   = _mm_and_pd(_mm_cmpge_pd(o, lo), _mm_cmple_pd(o, hi));
+            __m128d tmin = select(par, select(in, ninf, pinf), _mm_min_pd(tb, ta));
+            __m128d tmax = select(par, select(in, pinf, ninf), _mm_max_pd(ta, tb));
+            a = _mm_max_pd(tmin, a);
+            b = _mm_min_pd(tmax, b);
+        }
+        _mm_storeu_pd(t0+l, a);
+        _mm_storeu_pd(t1+l, b);
+        mask |= (uint32_t)_mm_movemask_pd(_mm_cmple_pd(a, b)) << l;
+    }
+#endif
+
+    for(; l<ray_packet_size; ++l)
+    {
+        vec3d o  (rp.o  [0][l], rp.o  [1][l], rp.o  [2][l]);
+        vec3d d  (rp.d  [0][l], rp.d  [1][l], rp.d  [2][l]);
+        vec3d inv(rp.inv[0][l], rp.inv[1][l], rp.inv[2][l]);
+        if(clip_ray(box, o, d, inv, t0[l], t1[l])) mask |= 1u<<l;
+    }
+    return mask & ((1u<<rp.n)-1);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool Twseventree::intersects_ray(const vec3d & p, const vec3d & dir, double & t, uint & id, const double t_max) const
+{
+    t = inf_double;
+    if(root==nullptr || dir.length_squared()==0) return false; // a zero direction hits nothing
+
+    vec3d  inv(1.0/dir[0], 1.0/dir[1], 1.0/dir[2]);
+    double t0 = 0, t1 = t_max;
+    if(!clip_ray(root->bbox, p, dir, inv, t0, t1)) return false;
+
+    double best = t_max;
+    int    hit  = -1;
+    ray_visit(root, p, dir, inv, t0, t1, best, hit);
+    if(hit<0) return false;
+    t  = best;
+    id = item_id(hit);
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint Twseventree::ray_children(const AABB   & box,
+                               const vec3d  & p,
+                               const vec3d  & dir,
+                               const vec3d  & inv,
+                               const double   t0,
+                               const double   t1,
+                                     uint     child[7],
+                                     double   t_in[7],
+                                     double   t_out[7]) const
+{
+    // 3D DDA on the 3x3x3 children: start from the child that contains the entry point (ties
+    // go to the child the ray is heading into), then cross one split plane at a time. A ray
+    // crosses at most 2 planes per axis, hence 7 children
+    double planes[3][4];
+    split_planes(box, planes);
+
+    int    cell[3];
+    double tn[3]; // t at which the ray crosses the next split plane along each axis
+    auto next_plane = [&](const int c) -> double
+    {
+        if(dir[c]>0 && cell[c]<2) return (planes[c][cell[c]+1] - p[c]) * inv[c];
+        if(dir[c]<0 && cell[c]>0) return (planes[c][cell[c]]   - p[c]) * inv[c];
+        return inf_double;
+    };
+    for(int c=0; c<3; ++c)
+    {
+        double x = p[c] + t0*dir[c];
+        cell[c]  = (dir[c]<0) ? (x>planes[c][1])  + (x>planes[c][2])
+                              : (x>=planes[c][1]) + (x>=planes[c][2]);
+        tn[c]    = next_plane(c);
+    }
+
+    uint   n = 0;
+    double t = t0;
+    while(true)
+    {
+        int c = (tn[0]<tn[1]) ? ((tn[0]<tn[2]) ? 0 : 2) : ((tn[1]<tn[2]) ? 1 : 2);
+        child[n] = cell[0] + 3*cell[1] + 9*cell[2];
+        t_in [n] = t;
+        t_out[n] = std::min(tn[c], t1);
+        ++n;
+        if(tn[c]>t1 || tn[c]==inf_double) break; // no plane left to cross (also for a zero direction)
+        t        = tn[c];
+        cell[c] += (dir[c]>0) ? 1 : -1;
+        tn[c]    = next_plane(c);
+    }
+    return n;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::ray_visit(const TwseventreeNode * node,
+                            const vec3d           & p,
+                            const vec3d           & dir,
+                            const vec3d           & inv,
+                            const double            t0,
+                            const double            t1,
+                                  double          & best,
+                                  int             & hit) const
+{
+    if(!node->is_inner)
+    {
+        // items may stick out of the leaf, hence hits are accepted at any t (ties go to the lowest index)
+        for(uint it : node->item_indices)
+        {
+            double t;
+            if(!item_ray_hit(it, p, dir, t) || t>best) continue;
+            if(t<best || hit<0 || (int)it<hit)
+            {
+                best = t;
+                hit  = (int)it;
+            }
+        }
+        return;
+    }
+
+    uint   child[7];
+    double t_in[7], t_out[7];
+    uint   n = ray_children(node->bbox, p, dir, inv, t0, t1, child, t_in, t_out);
+    for(uint i=0; i<n; ++i)
+    {
+        // stop if the closest hit comes before the next child
+        if(i>0 && best<=t_in[i]) break;
+        const TwseventreeNode *c = node->children[child[i]];
+        if(c!=nullptr) ray_visit(c, p, dir, inv, t_in[i], t_out[i], best, hit);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::intersects_ray_packet(const vec3d * p, const vec3d * dir, const uint n, double * t, int * ids, const double t_max) const
+{
+    assert(n<=ray_packet_size);
+    RayPacket rp;
+    rp.n = n;
+    uint32_t moving = 0; // lanes with a non zero direction
+    double   t0[ray_packet_size], t1[ray_packet_size];
+    for(uint l=0; l<n; ++l)
+    {
+        for(int c=0; c<3; ++c)
+        {
+            rp.o  [c][l] = p[l][c];
+            rp.d  [c][l] = dir[l][c];
+            rp.inv[c][l] = 1.0/dir[l][c];
+        }
+        rp.best[l] = t_max;
+        rp.hit [l] = -1;
+        t0[l] = 0;
+        t1[l] = t_max;
+        if(dir[l].length_squared()>0) moving |= 1u<<l;
+    }
+    for(uint l=n; l<ray_packet_size; ++l) // unused lanes are padded, as slab and triangle tests run on all of them
+    {
+        for(int c=0; c<3; ++c) rp.o[c][l] = rp.d[c][l] = rp.inv[c][l] = 0;
+        rp.best[l] = 0;
+        rp.hit [l] = -1;
+        t0[l] = t1[l] = 0;
+    }
+    uint32_t active = (root!=nullptr) ? moving & clip_ray_packet(root->bbox, rp, t0, t1) : 0;
+    if(active!=0) packet_visit(root, rp, active, t0, t1);
+
+    for(uint l=0; l<n; ++l)
+    {
+        ids[l] = (rp.hit[l]>=0) ? (int)item_id(rp.hit[l]) : -1;
+        t  [l] = (rp.hit[l]>=0) ? rp.best[l] : inf_double;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::packet_visit(const TwseventreeNode * node,
+                                     RayPacket       & rp,
+                               const uint32_t          active,
+                               const double          * t0,
+                               const double          * t1) const
+{
+    // a packet that lost coherence goes on as a single ray
+    if((active & (active-1))==0)
+    {
+        uint l = 0;
+        while(!(active & (1u<<l))) ++l;
+        vec3d o  (rp.o  [0][l], rp.o  [1][l], rp.o  [2][l]);
+        vec3d d  (rp.d  [0][l], rp.d  [1][l], rp.d  [2][l]);
+        vec3d inv(rp.inv[0][l], rp.inv[1][l], rp.inv[2][l]);
+        ray_visit(node, o, d, inv, t0[l], t1[l], rp.best[l], rp.hit[l]);
+        return;
+    }
+
+    if(!node->is_inner)
+    {
+        // each item is fetched once and tested against all the lanes (ray_triangle_hits for triangles),
+        // and the hits of the active lanes are merged afterwards
+        const double *o[3] = { rp.o[0], rp.o[1], rp.o[2] };
+        const double *d[3] = { rp.d[0], rp.d[1], rp.d[2] };
+        for(uint it : node->item_indices)
+        {
+            double   t[ray_packet_size];
+            uint32_t h = 0;
+            if(triangle_soa || items.at(it)->item_type()==TRIANGLE)
+            {
+                vec3d v0, v1, v2;
+                if(triangle_soa)
+                {
+                    v0 = soa_tris.vert(it,0);
+                    v1 = soa_tris.vert(it,1);
+                    v2 = soa_tris.vert(it,2);
+                }
+                else
+                {
+                    const Triangle *tri = static_cast<const Triangle*>(items.at(it));
+                    v0 = tri->v[0];
+                    v1 = tri->v[1];
+                    v2 = tri->v[2];
+                }
+                h = ray_triangle_hits(o, d, ray_packet_size, v0, v1, v2, t);
+            }
+            else
+            {
+                for(uint l=0; l<rp.n; ++l)
+                {
+                    vec3d lo(rp.o[0][l], rp.o[1][l], rp.o[2][l]);
+                    vec3d ld(rp.d[0][l], rp.d[1][l], rp.d[2][l]);
+                    if((active & (1u<<l)) && item_ray_hit(it, lo, ld, t[l])) h |= 1u<<l;
+                }
+            }
+
+            h &= active;
+            for(uint l=0; l<rp.n; ++l)
+            {
+                if(!(h & (1u<<l)) || t[l]>rp.best[l]) continue;
+                if(t[l]<rp.best[l] || rp.hit[l]<0 || (int)it<rp.hit[l])
+                {
+                    rp.best[l] = t[l];
+                    rp.hit [l] = (int)it;
+                }
+            }
+        }
+        return;
+    }
+
+    // children crossed by each lane (with the lane interval inside them), in order of first crossing
+    uint32_t lanes[27] = {};
+    double   c_t0[27][ray_packet_size];
+    double   c_t1[27][ray_packet_size];
+    uint     order[27];
+    uint     n_order = 0;
+    for(uint l=0; l<rp.n; ++l)
+    {
+        if(!(active & (1u<<l)) || rp.best[l]<t0[l]) continue;
+        vec3d  o  (rp.o  [0][l], rp.o  [1][l], rp.o  [2][l]);
+        vec3d  d  (rp.d  [0][l], rp.d  [1][l], rp.d  [2][l]);
+        vec3d  inv(rp.inv[0][l], rp.inv[1][l], rp.inv[2][l]);
+        uint   child[7];
+        double t_in[7], t_out[7];
+        uint   n = ray_children(node->bbox, o, d, inv, t0[l], t1[l], child, t_in, t_out);
+        for(uint i=0; i<n; ++i)
+        {
+            uint c = child[i];
+            if(node->children[c]==nullptr) continue;
+            if(lanes[c]==0) order[n_order++] = c;
+            lanes[c] |= 1u<<l;
+            c_t0 [c][l] = t_in [i];
+            c_t1 [c][l] = t_out[i];
+        }
+    }
+
+    // children front to back for the direction of the first active lane: along each axis they
+    // are visited in the order the ray moves, so that near hits shrink best[] for far children
+    uint first = 0;
+    while(!(active & (1u<<first))) ++first;
+    auto rank = [&](const uint c)
+    {
+        int r = 0;
+        for(int a=0, w=1; a<3; ++a, w*=3)
+        {
+            int x = (c/w)%3;
+            r += w * ((rp.d[a][first]<0) ? 2-x : x);
+        }
+        return r;
+    };
+    std::sort(order, order+n_order, [&](const uint a, const uint b){ return rank(a)<rank(b); });
+
+    for(uint i=0; i<n_order; ++i)
+    {
+        uint c = order[i];
+        // drop the lanes whose closest hit comes before the child
+        uint32_t m = lanes[c];
+        for(uint l=0; l<rp.n; ++l) if((m & (1u<<l)) && rp.best[l]<c_t0[c][l]) m &= ~(1u<<l);
+        if(m!=0) packet_visit(node->children[c], rp, m, c_t0[c], c_t1[c]);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::intersects_rays(const std::vector<vec3d> & p, const std::vector<vec3d> & dir, std::vector<double> & t, std::vector<int> & ids,
+                                  const double t_max, const bool coherent) const
+{
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    assert(p.size()==dir.size());
+    uint n = (uint)p.size();
+    t.resize(n);
+    ids.resize(n);
+    uint n_packets = 0;
+    if(coherent)
+    {
+        n_packets = (n + ray_packet_size - 1) / ray_packet_size;
+        PARALLEL_FOR(0, n_packets, 16, [&](uint k)
+        {
+            uint b = k*ray_packet_size;
+            uint m = std::min(uint(ray_packet_size), n-b);
+            intersects_ray_packet(p.data()+b, dir.data()+b, m, t.data()+b, ids.data()+b, t_max);
+        });
+    }
+    else
+    {
+        PARALLEL_FOR(0, n, 1000, [&](uint i)
+        {
+            uint id;
+            if(intersects_ray(p.at(i), dir.at(i), t.at(i), id, t_max)) ids.at(i) = (int)id;
+            else                                                       ids.at(i) = -1;
+        });
+    }
+
+    if(print_debug_info)
+    {
+        std::cout << "27tree ray casting: " << n << " rays";
+        if(coherent) std::cout << " in " << n_packets << " packets";
+        std::cout << " (" << how_many_seconds(t0, Time::now()) << "s)" << std::endl;
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint32_t Twseventree::child_mask(const TwseventreeNode * node, const uint it) const
+{
+    uint32_t mask;
+    child_masks(node, &it, 1, &mask, exact_triangle_box);
+    return mask;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::child_masks(const TwseventreeNode * node, const uint * its, const uint n, uint32_t * masks, const bool exact) const
+{
+    // split planes of the node along each axis. Child boxes are made of these very same
+    // values, so the arithmetic classification agrees bit by bit with the box/box tests
+    double planes[3][4];
+    split_planes(node->bbox, planes);
+
+    // gather item AABBs in small contiguous blocks and classify them
+    const uint block = 64;
+    double min[3][block], max[3][block];
+    for(uint beg=0; beg<n; beg+=block)
+    {
+        uint m = std::min(block, n-beg);
+        for(uint i=0; i<m; ++i)
+        {
+            uint it = its[beg+i];
+            if(triangle_soa)
+            {
+                for(int c=0; c<3; ++c)
+                {
+                    min[c][i] = soa_tris.min[c][it];
+                    max[c][i] = soa_tris.max[c][it];
+                }
+            }
+            else
+            {
+                const AABB & b = items.at(it)->aabb;
+                for(int c=0; c<3; ++c)
+                {
+                    min[c][i] = b.min[c];
+                    max[c][i] = b.max[c];
+                }
+            }
+        }
+        const double *pmin[3] = { min[0], min[1], min[2] };
+        const double *pmax[3] = { max[0], max[1], max[2] };
+        child_range_masks(pmin, pmax, m, planes, masks+beg);
+    }
+
+    if(!exact) return;
+
+    AABB child_bboxes[27];
+    for(uint j=0; j<27; ++j)
+    {
+        double cmin[3], cmax[3];
+        SpatialTreeLayout<3>::child_bbox(planes, j, cmin, cmax);
+        child_bboxes[j] = AABB(vec3d(cmin[0], cmin[1], cmin[2]), vec3d(cmax[0], cmax[1], cmax[2]));
+    }
+
+    for(uint i=0; i<n; ++i)
+    {
+        uint it = its[i];
+        if(!triangle_soa && items.at(it)->item_type()!=TRIANGLE) continue;
+
+        // the AABB test is only a prefilter: drop the children the triangle does not really touch
+        vec3d t[3];
+        if(triangle_soa) for(uint k=0; k<3; ++k) t[k] = soa_tris.vert(it,k);
+        else
+        {
+            const Triangle *tri = static_cast<const Triangle*>(items.at(it));
+            for(uint k=0; k<3; ++k) t[k] = tri->v[k];
+        }
+        uint32_t mask       = masks[i];
+        uint32_t exact_mask = mask;
+        for(int j=0; j<27; ++j)
+        {
+            if((mask & (1u<<j)) && !triangle_box_overlap(t, child_bboxes[j])) exact_mask &= ~(1u<<j);
+        }
+        // the test is conservative, hence a node may have accepted a triangle that only grazes it
+        // within roundoff, and that all its children reject. Keep the AABB answer in that case
+        if(exact_mask!=0 && exact_mask!=mask)
+        {
+            exact_rejections.fetch_add(std::bitset<27>(mask^exact_mask).count(), std::memory_order_relaxed);
+            masks[i] = exact_mask;
+        }
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void child_range_masks(const double * const min[3],
+                       const double * const max[3],
+                       const uint           n,
+                       const double         planes[3][4],
+                             uint32_t     * masks)
+{
+    // The 27 children form a regular 3x3x3 grid, hence along each axis the children
+    // overlapped by [lo,hi] are the contiguous range first..last, with
+    //      first = (lo > s1) + (lo > s2)
+    //      last  = (hi >= s1) + (hi >= s2)
+    // (closed boxes, as in AABB::intersects_box). Items are assumed to overlap the node.
+    // Comparisons are done for several items at once, one per SIMD lane.
+
+    uint i = 0;
+
+#if defined(__AVX__)
+    __m256d s1[3], s2[3];
+    for(int c=0; c<3; ++c)
+    {
+        s1[c] = _mm256_set1_pd(planes[c][1]);
+        s2[c] = _mm256_set1_pd(planes[c][2]);
+    }
+    for(; i+4<=n; i+=4)
+    {
+        uint first[4][3], last[4][3];
+        for(int c=0; c<3; ++c)
+        {
+            __m256d lo = _mm256_loadu_pd(min[c]+i);
+            __m256d hi = _mm256_loadu_pd(max[c]+i);
+            int a = _mm256_movemask_pd(_mm256_cmp_pd(lo, s1[c], _CMP_GT_OQ));
+            int b = _mm256_movemask_pd(_mm256_cmp_pd(lo, s2[c], _CMP_GT_OQ));
+            int d = _mm256_movemask_pd(_mm256_cmp_pd(hi, s1[c], _CMP_GE_OQ));
+            int e = _mm256_movemask_pd(_mm256_cmp_pd(hi, s2[c], _CMP_GE_OQ));
+            for(int l=0; l<4; ++l)
+            {
+                first[l][c] = ((a>>l)&1) + ((b>>l)&1);
+                last [l][c] = ((d>>l)&1) + ((e>>l)&1);
+            }
+        }
+        for(int l=0; l<4; ++l)
+        {
+            masks[i+l] = SpatialTreeLayout<3>::range_mask(first[l], last[l]);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128d s1[3], s2[3];
+    for(int c=0; c<3; ++c)
+    {
+        s1[c] = _mm_set1_pd(planes[c][1]);
+        s2[c] = _mm_set1_pd(planes[c][2]);
+    }
+    for(; i+2<=n; i+=2)
+    {
+        uint first[2][3], last[2][3];
+        for(int c=0; c<3; ++c)
+        {
+            __m128d lo = _mm_loadu_pd(min[c]+i);
+            __m128d hi = _mm_loadu_pd(max[c]+i);
+            int a = _mm_movemask_pd(_mm_cmpgt_pd(lo, s1[c]));
+            int b = _mm_movemask_pd(_mm_cmpgt_pd(lo, s2[c]));
+            int d = _mm_movemask_pd(_mm_cmpge_pd(hi, s1[c]));
+            int e = _mm_movemask_pd(_mm_cmpge_pd(hi, s2[c]));
+            for(int l=0; l<2; ++l)
+            {
+                first[l][c] = ((a>>l)&1) + ((b>>l)&1);
+                last [l][c] = ((d>>l)&1) + ((e>>l)&1);
+            }
+        }
+        for(int l=0; l<2; ++l)
+        {
+            masks[i+l] = SpatialTreeLayout<3>::range_mask(first[l], last[l]);
+        }
+    }
+#endif
+
+    for(; i<n; ++i)
+    {
+        uint first[3], last[3];
+        for(int c=0; c<3; ++c)
+        {
+            SpatialTreeLayout<3>::slab_range(planes[c], min[c][i], max[c][i], first[c], last[c]);
+        }
+        masks[i] = SpatialTreeLayout<3>::range_mask(first, last);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint * Twseventree::distribute_items(const TwseventreeNode * node, uint begin[28])
+{
+    // partitioned passes:
+    // 1) classify items in chunks, storing the children each item goes to and counting,
+    //    for each chunk, how many items go to each child. Big nodes process chunks in parallel
+    // 2) prefix sums of the per chunk counters give the size of each child list and, for
+    //    each chunk, its own slot in them. The 27 lists are allocated as one block
+    // 3) scatter the items. Chunks are merged in input order, therefore children lists are
+    //    the same for any chunk size and number of threads
+
+    const uint *src = node->item_indices.data();
+    uint n = (uint)node->item_indices.size();
+
+    bool parallel = n>=parallel_distribution_threshold;
+    uint chunk    = parallel ? distribution_chunk_size : n;
+    uint n_chunks = (n + chunk - 1) / chunk;
+
+    // small nodes reuse per thread scratch buffers, big nodes (only a few, near the root)
+    // allocate their own, so that no thread keeps a huge buffer alive after the build
+    thread_local std::vector<uint32_t> small_masks;
+    std::vector<uint32_t>              big_masks;
+    std::vector<std::array<uint,27>>   counts(n_chunks);
+    uint32_t *m;
+    if(parallel)
+    {
+        big_masks.resize(n);
+        m = big_masks.data();
+    }
+    else
+    {
+        small_masks.resize(n);
+        m = small_masks.data();
+    }
+    std::array<uint,27> *k = counts.data();
+
+    auto classify = [&](uint c)
+    {
+        uint beg = c*chunk;
+        uint end = std::min(n, beg+chunk);
+        k[c].fill(0);
+        child_masks(node, src+beg, end-beg, m+beg, exact_triangle_box);
+        for(uint i=beg; i<end; ++i)
+        {
+            assert(m[i]!=0); // orphan item
+            for(int j=0; j<27; ++j) k[c][j] += (m[i]>>j) & 1u;
+        }
+    };
+    if(parallel) PARALLEL_FOR(0, n_chunks, 0, classify);
+    else for(uint c=0; c<n_chunks; ++c) classify(c);
+
+    uint total = 0;
+    for(int j=0; j<27; ++j)
+    {
+        begin[j] = total;
+        for(uint c=0; c<n_chunks; ++c)
+        {
+            uint tmp = k[c][j];
+            k[c][j]  = total;
+            total   += tmp;
+        }
+        uint size = total - begin[j];
+        if(size>0) vector_allocs_estimate.fetch_add((size_t)std::floor(std::log2(size))+1, std::memory_order_relaxed);
+    }
+    begin[27] = total;
+
+    uint *block = index_pool.alloc(total);
+
+    auto scatter = [&](uint c)
+    {
+        uint beg = c*chunk;
+        uint end = std::min(n, beg+chunk);
+        std::array<uint,27> & offset = k[c];
+        for(uint i=beg; i<end; ++i)
+        {
+            for(int j=0; j<27; ++j)
+            {
+                if(m[i] & (1u<<j)) block[offset[j]++] = src[i];
+            }
+        }
+    };
+    if(parallel) PARALLEL_FOR(0, n_chunks, 0, scatter);
+    else for(uint c=0; c<n_chunks; ++c) scatter(c);
+
+    return block;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::compact_item_indices()
+{
+    leaf_offsets.resize(leaves.size()+1);
+    leaf_offsets.front() = 0;
+    for(uint i=0; i<leaves.size(); ++i)
+    {
+        leaf_offsets.at(i+1) = leaf_offsets.at(i) + (uint)leaves.at(i)->item_indices.size();
+    }
+
+    std::vector<uint> tmp(leaf_offsets.back());
+    PARALLEL_FOR(0, (uint)leaves.size(), 1000, [&](uint i)
+    {
+        std::copy(leaves.at(i)->item_indices.begin(), leaves.at(i)->item_indices.end(), tmp.begin() + leaf_offsets.at(i));
+    });
+    leaf_item_ids.swap(tmp);
+
+    // leaves are the only nodes with items, and they are reachable only through the
+    // leaves vector, hence it is safe to cast away constness here
+    for(uint i=0; i<leaves.size(); ++i)
+    {
+        TwseventreeNode *l = const_cast<TwseventreeNode*>(leaves.at(i));
+        l->item_indices.ptr = leaf_item_ids.data() + leaf_offsets.at(i);
+    }
+
+    index_pool.clear(); // also the lists of past edits
+    csr_stale = false;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool ray_triangle_hit(const vec3d & p, const vec3d & dir, const vec3d & v0, const vec3d & v1, const vec3d & v2, double & t)
+{
+    // multiply-adds are spelled out, and fused only if the target has FMA: the compiler is then left
+    // with nothing to fuse, and the SIMD lanes of ray_triangle_hits round exactly as this code does
+    auto madd = [](const double x, const double y, const double z) // x*y + z
+    {
+#if defined(__FMA__)
+        return std::fma(x, y, z);
+#else
+        return x*y + z;
+#endif
+    };
+    auto msub = [](const double x, const double y, const double z) // x*y - z
+    {
+#if defined(__FMA__)
+        return std::fma(x, y, -z);
+#else
+        return x*y - z;
+#endif
+    };
+    vec3d  e1 = v1 - v0;
+    vec3d  e2 = v2 - v0;
+    vec3d  s  = p  - v0;
+    double hx = msub(dir[1], e2[2], dir[2]*e2[1]); // h = dir x e2
+    double hy = msub(dir[2], e2[0], dir[0]*e2[2]);
+    double hz = msub(dir[0], e2[1], dir[1]*e2[0]);
+    double a  = madd(e1[2], hz, madd(e1[1], hy, e1[0]*hx));
+    if(a==0) return false; // ray parallel to the triangle, or degenerate triangle
+    double f  = 1.0/a;
+    double u  = f * madd(s[2], hz, madd(s[1], hy, s[0]*hx));
+    if(u<0 || u>1) return false;
+    double qx = msub(s[1], e1[2], s[2]*e1[1]); // q = s x e1
+    double qy = msub(s[2], e1[0], s[0]*e1[2]);
+    double qz = msub(s[0], e1[1], s[1]*e1[0]);
+    double v  = f * madd(dir[2], qz, madd(dir[1], qy, dir[0]*qx));
+    if(v<0 || u+v>1) return false;
+    t = f * madd(e2[2], qz, madd(e2[1], qy, e2[0]*qx));
+    return t>=0;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+uint32_t ray_triangle_hits(const double * const o[3],
+                           const double * const d[3],
+                           const uint           n,
+                           const vec3d        & v0,
+                           const vec3d        & v1,
+                           const vec3d        & v2,
+                                 double       * t)
+{
+    // The operations of ray_triangle_hit, in the same order, without branches: a lane hits if
+    // a != 0, 0 <= u <= 1, v >= 0, u+v <= 1 and t >= 0
+    assert(n<=32);
+    vec3d    e1   = v1 - v0;
+    vec3d    e2   = v2 - v0;
+    uint32_t mask = 0;
+    uint     l    = 0;
+
+#if defined(__AVX__)
+    auto madd = [](const __m256d x, const __m256d y, const __m256d z) // x*y + z, fused as in ray_triangle_hit
+    {
+#if defined(__FMA__)
+        return _mm256_fmadd_pd(x, y, z);
+#else
+        return _mm256_add_pd(_mm256_mul_pd(x, y), z);
+#endif
+    };
+    auto msub = [](const __m256d x, const __m256d y, const __m256d z) // x*y - z
+    {
+#if defined(__FMA__)
+        return _mm256_fmsub_pd(x, y, z);
+#else
+        return _mm256_sub_pd(_mm256_mul_pd(x, y), z);
+#endif
+    };
+    __m256d E1[3], E2[3], V0[3];
+    for(int c=0; c<3; ++c)
+    {
+        E1[c] = _mm256_set1_pd(e1[c]);
+        E2[c] = _mm256_set1_pd(e2[c]);
+        V0[c] = _mm256_set1_pd(v0[c]);
+    }
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one  = _mm256_set1_pd(1.0);
+    for(; l+4<=n; l+=4)
+    {
+        __m256d dx = _mm256_loadu_pd(d[0]+l), dy = _mm256_loadu_pd(d[1]+l), dz = _mm256_loadu_pd(d[2]+l);
+        __m256d sx = _mm256_sub_pd(_mm256_loadu_pd(o[0]+l), V0[0]);
+        __m256d sy = _mm256_sub_pd(_mm256_loadu_pd(o[1]+l), V0[1]);
+        __m256d sz = _mm256_sub_pd(_mm256_loadu_pd(o[2]+l), V0[2]);
+        __m256d hx = msub(dy, E2[2], _mm256_mul_pd(dz, E2[1]));
+        __m256d hy = msub(dz, E2[0], _mm256_mul_pd(dx, E2[2]));
+        __m256d hz = msub(dx, E2[1], _mm256_mul_pd(dy, E2[0]));
+        __m256d a  = madd(E1[2], hz, madd(E1[1], hy, _mm256_mul_pd(E1[0], hx)));
+        __m256d f  = _mm256_div_pd(one, a);
+        __m256d u  = _mm256_mul_pd(f, madd(sz, hz, madd(sy, hy, _mm256_mul_pd(sx, hx))));
+        __m256d qx = msub(sy, E1[2], _mm256_mul_pd(sz, E1[1]));
+        __m256d qy = msub(sz, E1[0], _mm256_mul_pd(sx, E1[2]));
+        __m256d qz = msub(sx, E1[1], _mm256_mul_pd(sy, E1[0]));
+        __m256d v  = _mm256_mul_pd(f, madd(dz, qz, madd(dy, qy, _mm256_mul_pd(dx, qx))));
+        __m256d tl = _mm256_mul_pd(f, madd(E2[2], qz, madd(E2[1], qy, _mm256_mul_pd(E2[0], qx))));
+        __m256d h  = _mm256_and_pd(_mm256_cmp_pd(a, zero, _CMP_NEQ_UQ), _mm256_cmp_pd(u, zero, _CMP_GE_OQ));
+        h = _mm256_and_pd(h, _mm256_and_pd(_mm256_cmp_pd(u, one, _CMP_LE_OQ), _mm256_cmp_pd(v, zero, _CMP_GE_OQ)));
+        h = _mm256_and_pd(h, _mm256_and_pd(_mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ), _mm256_cmp_pd(tl, zero, _CMP_GE_OQ)));
+        _mm256_storeu_pd(t+l, tl);
+        mask |= (uint32_t)_mm256_movemask_pd(h) << l;
+    }
+#elif defined(__SSE2__)
+    // no FMA without AVX: plain multiply and add, as in ray_triangle_hit
+    __m128d E1[3], E2[3], V0[3];
+    for(int c=0; c<3; ++c)
+    {
+        E1[c] = _mm_set1_pd(e1[c]);
+        E2[c] = _mm_set1_pd(e2[c]);
+        V0[c] = _mm_set1_pd(v0[c]);
+    }
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one  = _mm_set1_pd(1.0);
+    for(; l+2<=n; l+=2)
+    {
+        __m128d dx = _mm_loadu_pd(d[0]+l), dy = _mm_loadu_pd(d[1]+l), dz = _mm_loadu_pd(d[2]+l);
+        __m128d sx = _mm_sub_pd(_mm_loadu_pd(o[0]+l), V0[0]);
+        __m128d sy = _mm_sub_pd(_mm_loadu_pd(o[1]+l), V0[1]);
+        __m128d sz = _mm_sub_pd(_mm_loadu_pd(o[2]+l), V0[2]);
+        __m128d hx = _mm_sub_pd(_mm_mul_pd(dy, E2[2]), _mm_mul_pd(dz, E2[1]));
+        __m128d hy = _mm_sub_pd(_mm_mul_pd(dz, E2[0]), _mm_mul_pd(dx, E2[2]));
+        __m128d hz = _mm_sub_pd(_mm_mul_pd(dx, E2[1]), _mm_mul_pd(dy, E2[0]));
+        __m128d a  = _mm_add_pd(_mm_mul_pd(E1[2], hz), _mm_add_pd(_mm_mul_pd(E1[1], hy), _mm_mul_pd(E1[0], hx)));
+        __m128d f  = _mm_div_pd(one, a);
+        __m128d u  = _mm_mul_pd(f, _mm_add_pd(_mm_mul_pd(sz, hz), _mm_add_pd(_mm_mul_pd(sy, hy), _mm_mul_pd(sx, hx))));
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, E1[2]), _mm_mul_pd(sz, E1[1]));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, E1[0]), _mm_mul_pd(sx, E1[2]));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, E1[1]), _mm_mul_pd(sy, E1[0]));
+        __m128d v  = _mm_mul_pd(f, _mm_add_pd(_mm_mul_pd(dz, qz), _mm_add_pd(_mm_mul_pd(dy, qy), _mm_mul_pd(dx, qx))));
+        __m128d tl = _mm_mul_pd(f, _mm_add_pd(_mm_mul_pd(E2[2], qz), _mm_add_pd(_mm_mul_pd(E2[1], qy), _mm_mul_pd(E2[0], qx))));
+        __m128d h  = _mm_and_pd(_mm_cmpneq_pd(a, zero), _mm_cmpge_pd(u, zero));
+        h = _mm_and_pd(h, _mm_and_pd(_mm_cmple_pd(u, one), _mm_cmpge_pd(v, zero)));
+        h = _mm_and_pd(h, _mm_and_pd(_mm_cmple_pd(_mm_add_pd(u, v), one), _mm_cmpge_pd(tl, zero)));
+        _mm_storeu_pd(t+l, tl);
+        mask |= (uint32_t)_mm_movemask_pd(h) << l;
+    }
+#endif
+
+    for(; l<n; ++l)
+    {
+        vec3d p  (o[0][l], o[1][l], o[2][l]);
+        vec3d dir(d[0][l], d[1][l], d[2][l]);
+        if(ray_triangle_hit(p, dir, v0, v1, v2, t[l])) mask |= 1u<<l;
+    }
+    return mask;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool triangle_box_overlap(const vec3d t[], const AABB & box)
+{
+    // Separating axis test (Akenine-Moller) between a triangle and a closed box.
+    // It is conservative: it answers false only if the triangle certainly misses the box.
+    // Box axes are decided exactly by comparisons, the triangle plane is decided exactly
+    // by Shewchuk's orient3d, and the 9 edge/axis cross products are computed in floating
+    // point and accepted as separating only if the gap exceeds a bound on the roundoff.
+
+    for(int i=0; i<3; ++i)
+    {
+        if(std::max(t[0][i], std::max(t[1][i], t[2][i])) < box.min[i]) return false;
+        if(std::min(t[0][i], std::min(t[1][i], t[2][i])) > box.max[i]) return false;
+    }
+
+    bool pos = false, neg = false;
+    for(const vec3d & c : box.corners())
+    {
+        double o = orient3d(t[0], t[1], t[2], c);
+        if(o>=0) pos = true;
+        if(o<=0) neg = true;
+    }
+    if(!pos || !neg) return false; // all corners strictly on one side of the triangle plane
+
+    vec3d c = box.center();
+    vec3d h = box.delta()/2.0;
+    vec3d v[3] = { t[0]-c, t[1]-c, t[2]-c };
+    vec3d e[3] = { v[1]-v[0], v[2]-v[1], v[0]-v[2] };
+
+    double scale = 0;
+    for(int i=0; i<3; ++i) scale = std::max(scale, std::max(std::fabs(v[i][0]), std::max(std::fabs(v[i][1]), std::fabs(v[i][2]))));
+    scale = std::max(scale, h.max_entry());
+
+    for(int i=0; i<3; ++i)
+    for(int j=0; j<3; ++j)
+    {
+        // axis = e[i] x unit_j
+        vec3d a(0,0,0);
+        a[(j+1)%3] =  e[i][(j+2)%3];
+        a[(j+2)%3] = -e[i][(j+1)%3];
+
+        double p0 = a.dot(v[0]);
+        double p1 = a.dot(v[1]);
+        double p2 = a.dot(v[2]);
+        double r  = h[0]*std::fabs(a[0]) + h[1]*std::fabs(a[1]) + h[2]*std::fabs(a[2]);
+        double l1 = std::fabs(a[0]) + std::fabs(a[1]) + std::fabs(a[2]);
+        double err = 16 * std::numeric_limits<double>::epsilon() * l1 * scale;
+
+        if(std::min(p0, std::min(p1,p2)) - r > err) return false;
+        if(std::max(p0, std::max(p1,p2)) + r < -err) return false;
+    }
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeTriangles::reserve(const uint n)
+{
+    ids.reserve(n);
+    for(int c=0; c<3; ++c)
+    {
+        for(int k=0; k<3; ++k) v[k][c].reserve(n);
+        min[c].reserve(n);
+        max[c].reserve(n);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeTriangles::resize(const uint n)
+{
+    ids.resize(n);
+    for(int c=0; c<3; ++c)
+    {
+        for(int k=0; k<3; ++k) v[k][c].resize(n);
+        min[c].resize(n);
+        max[c].resize(n);
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeTriangles::clear()
+{
+    ids.clear();
+    for(int c=0; c<3; ++c)
+    {
+        for(int k=0; k<3; ++k) v[k][c].clear();
+        min[c].clear();
+        max[c].clear();
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeTriangles::push(const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2)
+{
+    resize(size()+1);
+    set(size()-1, id, v0, v1, v2);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void TwseventreeTriangles::set(const uint i, const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2)
+{
+    ids[i] = id;
+    for(int c=0; c<3; ++c)
+    {
+        v[0][c][i] = v0[c];
+        v[1][c][i] = v1[c];
+        v[2][c][i] = v2[c];
+        min[c][i]  = std::min(v0[c], std::min(v1[c], v2[c]));
+        max[c][i]  = std::max(v0[c], std::max(v1[c], v2[c]));
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+size_t TwseventreeTriangles::num_bytes() const
+{
+    size_t bytes = ids.capacity()*sizeof(uint);
+    for(int c=0; c<3; ++c)
+    {
+        for(int k=0; k<3; ++k) bytes += v[k][c].capacity()*sizeof(double);
+        bytes += (min[c].capacity() + max[c].capacity())*sizeof(double);
+    }
+    return bytes;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::benchmark_child_classification(const uint rounds) const
+{
+    // Microbenchmark: classification of all items against the children of the root,
+    // with the 27 box/box tests per item of the original loop vs child_range_masks()
+    if(root==nullptr || !root->is_inner) return;
+
+    typedef std::chrono::high_resolution_clock Time;
+    uint n = num_items();
+    std::vector<uint32_t> masks_box(n), masks_arith(n);
+    std::vector<uint>     its(n);
+    std::iota(its.begin(), its.end(), 0);
+
+    AABB child_bboxes[27];
+    for(uint i=0; i<27; ++i) child_bboxes[i] = child_bbox(root, i);
+
+    Time::time_point t0 = Time::now();
+    for(uint r=0; r<rounds; ++r)
+    {
+        for(uint it=0; it<n; ++it)
+        {
+            AABB     b    = item_aabb(it);
+            uint32_t mask = 0;
+            for(int i=0; i<27; ++i)
+            {
+                if(child_bboxes[i].intersects_box(b)) mask |= (1u<<i);
+            }
+            masks_box[it] = mask;
+        }
+    }
+    Time::time_point t1 = Time::now();
+    for(uint r=0; r<rounds; ++r)
+    {
+        child_masks(root, its.data(), n, masks_arith.data(), false); // time the AABB classification only
+    }
+    Time::time_point t2 = Time::now();
+
+    double t_box   = how_many_seconds(t0,t1);
+    double t_arith = how_many_seconds(t1,t2);
+    std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+    std::cout << "Child classification benchmark (" << n << " items x " << rounds << " rounds)" << std::endl;
+    std::cout << "27 box tests per item    : " << t_box   << "s" << std::endl;
+    std::cout << "Arithmetic ranges (SIMD) : " << t_arith << "s" << std::endl;
+    std::cout << "Speedup                  : " << t_box/t_arith << "x" << std::endl;
+    std::cout << "Same classification      : " << (masks_box==masks_arith) << std::endl;
+    std::cout << ":::::::::::::::::::::::::::::::::::::::::::::::::::" << std::endl;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::push_point(const uint id, const vec3d & v)
+{
+    assert(!triangle_soa);
+    items.push_back(new Point(id,v));
+}
+
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
 void Twseventree::push_sphere(const uint id, const vec3d & c, const double r)
 {
+    assert(!triangle_soa);
     items.push_back(new Sphere(id,c,r));
 }
 
@@ -316,6 +2964,7 @@ void Twseventree::push_sphere(const uint id, const vec3d & c, const double r)
 CINO_INLINE
 void Twseventree::push_segment(const uint id, const std::vector<vec3d> & v)
 {
+    assert(!triangle_soa);
     items.push_back(new Segment(id,v.data()));
 }
 
@@ -324,7 +2973,92 @@ void Twseventree::push_segment(const uint id, const std::vector<vec3d> & v)
 CINO_INLINE
 void Twseventree::push_triangle(const uint id, const std::vector<vec3d> & v)
 {
-    items.push_back(new Triangle(id,v.data()));
+    if(triangle_soa) soa_tris.push(id, v.at(0), v.at(1), v.at(2));
+    else items.push_back(new Triangle(id,v.data()));
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::push_triangle(const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2)
+{
+    if(triangle_soa) soa_tris.push(id, v0, v1, v2);
+    else
+    {
+        vec3d v[3] = { v0, v1, v2 };
+        items.push_back(new Triangle(id,v));
+    }
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void Twseventree::build_from_buffers(const double * xyz,  const size_t nv,
+                                     const uint   * tris, const size_t nt)
+{
+    assert(num_items()==0);
+    assert(nt < std::numeric_limits<uint>::max());
+    (void)nv;
+
+    typedef std::chrono::high_resolution_clock Time;
+    Time::time_point t0 = Time::now();
+
+    triangle_soa = true;
+    soa_tris.resize((uint)nt);
+
+    // each triangle writes only its own slot of the flat arrays
+    const uint chunk    = 4096;
+    const uint n_chunks = (uint)((nt + chunk - 1) / chunk);
+    PARALLEL_FOR(0, n_chunks, 2, [&](uint c)
+    {
+        uint end = (uint)std::min(nt, (size_t)(c+1)*chunk);
+        for(uint i=c*chunk; i<end; ++i)
+        {
+            const uint *t = tris + 3*(size_t)i;
+            assert(t[0]<nv && t[1]<nv && t[2]<nv);
+            soa_tris.set(i, i, vec3d(xyz[3*(size_t)t[0]], xyz[3*(size_t)t[0]+1], xyz[3*(size_t)t[0]+2]),
+                               vec3d(xyz[3*(size_t)t[1]], xyz[3*(size_t)t[1]+1], xyz[3*(size_t)t[1]+2]),
+                               vec3d(xyz[3*(size_t)t[2]], xyz[3*(size_t)t[2]+1], xyz[3*(size_t)t[2]+2]));
+        }
+    });
+
+    if(print_debug_info)
+    {
+        Time::time_point t1 = Time::now();
+        std::cout << "Ingested " << nt << " triangles (" << how_many_seconds(t0,t1) << "s)" << std::endl;
+    }
+
+    build();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+AABB Twseventree::items_bbox() const
+{
+    AABB bbox;
+    if(!triangle_soa)
+    {
+        for(auto it : items) bbox.push(it->aabb);
+        return bbox;
+    }
+
+    // chunked min/max reduction over the flat AABB arrays
+    const uint chunk    = 65536;
+    const uint n_chunks = (soa_tris.size() + chunk - 1) / chunk;
+    std::vector<AABB> partial(n_chunks);
+    PARALLEL_FOR(0, n_chunks, 2, [&](uint c)
+    {
+        uint beg = c*chunk;
+        uint end = std::min(soa_tris.size(), beg+chunk);
+        for(int i=0; i<3; ++i)
+        {
+            partial.at(c).min[i] = *std::min_element(soa_tris.min[i].begin()+beg, soa_tris.min[i].begin()+end);
+            partial.at(c).max[i] = *std::max_element(soa_tris.max[i].begin()+beg, soa_tris.max[i].begin()+end);
+        }
+    });
+    for(const AABB & b : partial) bbox.push(b);
+    return bbox;
 }
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -332,6 +3066,7 @@ void Twseventree::push_triangle(const uint id, const std::vector<vec3d> & v)
 CINO_INLINE
 void Twseventree::push_tetrahedron(const uint id, const std::vector<vec3d> & v)
 {
+    assert(!triangle_soa);
     items.push_back(new Tetrahedron(id,v.data()));
 }
 
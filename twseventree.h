@@ -33,26 +33,225 @@
 
 #include <cinolib/geometry/spatial_data_structure_item.h>
 #include <cinolib/meshes/meshes.h>
+#include <spatial_tree.h>
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
 
 namespace cinolib
 {
 
+// View on a contiguous list of item indices. Lists are not owned by the nodes: during the
+// build they live in a TwseventreeIndexPool, and after the build the lists of all the leaves
+// are compacted in a single CSR array owned by the tree (Twseventree::leaf_item_indices)
+struct TwseventreeItemList
+{
+    uint *ptr   = nullptr;
+    uint  count = 0;
+
+    uint * begin() const { return ptr;         }
+    uint * end()   const { return ptr + count; }
+    uint * data()  const { return ptr;         }
+    size_t size()  const { return count;       }
+    bool   empty() const { return count==0;    }
+    uint & operator[](const uint i) const { return ptr[i]; }
+    void   clear() { ptr = nullptr; count = 0; }
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
 class TwseventreeNode
 {
     public:
         TwseventreeNode(const TwseventreeNode * father, const AABB & bbox) : father(father), bbox(bbox) {}
-       ~TwseventreeNode();
+        // nodes do not own their children: they all live in a TwseventreeNodePool
+        // and are released at once when the pool is cleared. Children of inner nodes
+        // that receive no items are not allocated (nullptr): they are implicit leaves
         const TwseventreeNode *father;
         TwseventreeNode       *children[27] = { nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
                                                 nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
                                                 nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
         bool              is_inner = false;
         AABB              bbox;
-        std::vector<uint> item_indices; // index Twseventree::items, avoiding to store a copy of the same object multiple times in each node it appears
+        TwseventreeItemList item_indices; // index Twseventree::items, avoiding to store a copy of the same object multiple times in each node it appears
+};
+
+
+CINO_INLINE
+bool triangle_box_overlap(const vec3d t[], const AABB & box); // conservative, never misses a contact
+
+// Moller-Trumbore ray/triangle test. t is in units of dir, and hits behind p (t < 0) are rejected
+CINO_INLINE
+bool ray_triangle_hit(const vec3d & p, const vec3d & dir, const vec3d & v0, const vec3d & v1, const vec3d & v2, double & t);
+
+// Moller-Trumbore test of one triangle against n rays in SoA layout (coordinate c of the i-th
+// ray in o[c][i], d[c][i]), several rays at once, one per SIMD lane. Each lane performs the
+// operations of ray_triangle_hit, hence gets the same answer. Returns the mask of the rays that
+// hit the triangle, at t[i] (n <= 32)
+CINO_INLINE
+uint32_t ray_triangle_hits(const double * const o[3],
+                           const double * const d[3],
+                           const uint           n,
+                           const vec3d        & v0,
+                           const vec3d        & v1,
+                           const vec3d        & v2,
+                                 double       * t);
+
+// For each of the n AABBs (coordinate c of the i-th box in min[c][i], max[c][i]) computes the
+// mask of the children of a node it overlaps, given the 4 split planes of the node per axis
+CINO_INLINE
+void child_range_masks(const double * const min[3],
+                       const double * const max[3],
+                       const uint           n,
+                       const double         planes[3][4],
+                             uint32_t     * masks);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// Arena for the nodes of a Twseventree. Siblings are allocated as one contiguous block
+// (27 nodes per subdivide), and the whole tree is released at once by clear(), walking
+// the chunks linearly instead of recursively deleting nodes one by one.
+class TwseventreeNodePool
+{
+    public:
+        explicit TwseventreeNodePool(const uint min_chunk_size = 27*64,
+                                     const uint max_chunk_size = 27*4096);
+       ~TwseventreeNodePool();
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        TwseventreeNode * alloc(const TwseventreeNode * father, const AABB * bboxes, const uint n); // thread safe
+        void              clear();
+
+        // reset(c) releases all the nodes allocated after c = checkpoint() (not thread safe)
+        struct Checkpoint { size_t chunks; uint used; size_t nodes; };
+        Checkpoint checkpoint() const;
+        void       reset(const Checkpoint & c);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        size_t num_nodes () const { return nodes_count;   }
+        size_t num_chunks() const { return chunks.size(); }
+        size_t num_bytes () const { return bytes_count;   }
+
+    private:
+
+        struct Chunk
+        {
+            TwseventreeNode *data;
+            uint             size;
+            uint             used;
+        };
+
+        std::vector<Chunk> chunks;
+        uint               min_chunk_size;
+        uint               max_chunk_size;
+        size_t             nodes_count = 0;
+        size_t             bytes_count = 0;
+        std::mutex         mutex;
 };
 
 
+// Flat structure of arrays storage for triangle soups. Vertices and AABBs are stored
+// coordinate by coordinate in contiguous arrays, so that the build loops read them
+// linearly, without heap allocated polymorphic items and virtual calls.
+struct TwseventreeTriangles
+{
+    std::vector<uint>   ids;
+    std::vector<double> v[3][3];  // v[k][c] = coordinate c of the k-th vertex of each triangle
+    std::vector<double> min[3];   // AABB of each triangle
+    std::vector<double> max[3];
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    uint size() const { return (uint)ids.size(); }
+    void reserve(const uint n);
+    void resize (const uint n);
+    void clear();
+    void push(const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2);
+    void set (const uint i, const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2);
+
+    //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+    vec3d  vert (const uint i, const uint k) const { return vec3d(v[k][0][i], v[k][1][i], v[k][2][i]); }
+    AABB   aabb (const uint i) const { return AABB(vec3d(min[0][i], min[1][i], min[2][i]), vec3d(max[0][i], max[1][i], max[2][i])); }
+    size_t num_bytes() const;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// Sizing field sampled on a regular grid of n[0] x n[1] x n[2] nodes spanning box (values are stored
+// x first), trilinearly interpolated. Points outside box take the value of the closest point of box
+struct TwseventreeSizingGrid
+{
+    AABB                box;
+    uint                n[3] = { 0, 0, 0 };
+    std::vector<double> values;
+
+    double operator()(const vec3d & p) const;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// Bump allocator for the item index lists of the nodes. Memory is only released by clear()
+class TwseventreeIndexPool
+{
+    public:
+        explicit TwseventreeIndexPool(const size_t chunk_size = 1<<20);
+       ~TwseventreeIndexPool();
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        uint * alloc(const size_t n); // thread safe
+        void   clear();
+
+        // reset(c) releases all the lists allocated after c = checkpoint() (not thread safe)
+        struct Checkpoint { size_t chunks; size_t used; };
+        Checkpoint checkpoint() const;
+        void       reset(const Checkpoint & c);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        size_t num_allocs() const { return chunks.size(); }
+        size_t num_bytes () const { return bytes_count;   }
+
+    private:
+
+        struct Chunk
+        {
+            uint   *data;
+            size_t  size;
+            size_t  used;
+        };
+
+        std::vector<Chunk> chunks;
+        size_t             chunk_size;
+        size_t             bytes_count = 0;
+        std::mutex         mutex;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+// Caller owned scratch memory of the range queries. A query only writes in its context, hence any
+// number of threads can query the same tree at once, each with its own context. Vectors keep their
+// capacity across queries: once a context has served its largest query, it no longer allocates
+struct TwseventreeQueryContext
+{
+    std::vector<uint>                   ids;    // results: ids of the items found
+    std::vector<const TwseventreeNode*> leaves; // results: leaves visited (query_leaves), scratch otherwise
+
+    std::vector<const TwseventreeNode*> stack;  // traversal stack
+    std::vector<uint>                   stamps; // per item, last query that reported it (items span several leaves)
+    uint                                stamp = 0;
+
+    void begin(const uint n_items); // clears the results and opens a new stamp
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
 class Twseventree
 {
     public:
@@ -66,8 +265,15 @@ class Twseventree
         void push_sphere     (const uint id, const vec3d & c, const double r);
         void push_segment    (const uint id, const std::vector<vec3d> & v);
         void push_triangle   (const uint id, const std::vector<vec3d> & v);
+        void push_triangle   (const uint id, const vec3d & v0, const vec3d & v1, const vec3d & v2);
         void push_tetrahedron(const uint id, const std::vector<vec3d> & v);
 
+        // triangle only storage: push_triangle fills the flat arrays in triangles() instead of
+        // items, and no other item type can be pushed. Must be set before pushing anything
+        void set_triangle_soa(const bool b) { assert(num_items()==0); triangle_soa = b; }
+        bool uses_triangle_soa() const { return triangle_soa; }
+        const TwseventreeTriangles & triangles() const { return soa_tris; }
+
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
         void build();
@@ -75,22 +281,147 @@ class Twseventree
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
         void subdivide(TwseventreeNode *node);
+        bool needs_split(const TwseventreeNode *node, const uint depth) const; // depth of node (root = 1)
+
+        // if true, the root is not padded to a cube centered on the items, but is anchored at their
+        // min corner, and the cells of its top levels that fall entirely beyond the items are dropped.
+        // The grid then covers an NxMxK brick of equal cubes that follows the aspect ratio of the input
+        void set_root_brick(const bool b) { root_brick = b; }
+        bool in_root_brick(const AABB & cell) const; // false for cells dropped outside the brick
+
+        // anchors the tree to a global lattice of cubes of side base, with a corner in origin (base = 0
+        // disables it). Base cells are the coarsest cells of the grid: the root is the smallest cube of
+        // 3^k base cells covering the items, with a corner on the lattice, and it is split down to the
+        // base cells, dropping those beyond the items. Depths are counted from the base cells (which
+        // are at tree depth k+1), and boxes of cells not coarser than base are computed from integer
+        // lattice coordinates: the same cell gets bit-identical boxes in any tree anchored the same way
+        void set_lattice(const vec3d & origin, const double base) { lattice_origin = origin; lattice_base = base; }
+        uint lattice_base_depth() const { return lattice_levels+1; } // tree depth of the base cells (1 if not anchored)
+        const vec3d & lattice_origin_point() const { return lattice_origin; }
+        double        lattice_base_side   () const { return lattice_base;   } // 0 if not anchored
+
+        // budgeted refinement: if n > 0, rather than splitting all the leaves that need it, build()
+        // always splits next the leaf with the highest error (items times cell size), and stops as soon
+        // as the predicted number of cells of the final hexmesh reaches n (0 disables it). Anchored trees
+        // are always split down to the base cells, which count toward n
+        void set_cell_budget(const size_t n) { cell_budget = n; }
+
+        // cells of the hexmesh predicted after balancing and transitions. A leaf touching leaves k levels
+        // finer costs 1 + 26k cells, i.e. a 27 split per level of difference (balancing splits for all
+        // levels but the last, and a transition scheme of up to 27 cells for the last one)
+        size_t predict_num_cells(size_t *n_leaves = nullptr) const;
+
+        // sizing field driven refinement: leaves split while they are bigger than the smallest target
+        // size of their items, rather than while they hold more than items_per_leaf items. The field
+        // is sampled once per item, at the vertices and centroid of triangles, and at the center of
+        // the AABB of other items. Any callable works, e.g. a TwseventreeSizingGrid
+        typedef std::function<double(const vec3d & p)> SizingField;
+        void set_sizing_field(const SizingField & f) { sizing_field = f; }
+
+        // curvature driven refinement: leaves holding triangles whose normals deviate by more than
+        // angle (radians) split, so flat regions stay coarse however finely they are triangulated,
+        // down to the size of the triangles. Can be combined with a sizing field: a leaf splits if
+        // either criterion asks for it
+        void set_max_normal_deviation(const double angle) { max_normal_deviation = angle; }
+
+        // hybrid build: the first k levels below the root are computed at once, voxelizing the items
+        // in parallel on dense grids of 3^l cells per axis (l=1..k), and only the occupied cells of
+        // the last one go on with the recursive refinement. The tree is the same of the recursive
+        // build. Used with the items per leaf criterion and the AABB classification only
+        void set_dense_levels(const uint k) { assert(k<=5); dense_levels = k; }
+
+        // box of the i-th child of an inner node, also if the child is empty and was not allocated
+        AABB child_bbox(const TwseventreeNode *node, const uint i) const { return child_bbox(node->bbox, i); }
+        AABB child_bbox(const AABB & cell, const uint i) const;
+
+        // depth first visit of all the leaves, root = depth 1. Empty children of inner nodes
+        // are visited as implicit leaves, with leaf == nullptr (except those out of the root brick).
+        // Implicit leaves coarser than the lattice base cells are visited as their base cells
+        void for_each_leaf(const std::function<void(const AABB & bbox, const TwseventreeNode *leaf, const uint depth)> & f) const;
+
+        // incremental editing of a built tree, at a cost proportional to the edit. New triangles (tris
+        // holds 3 vertex ids per triangle, ids one id per triangle) are appended to the items and added
+        // to the leaves they overlap, which split as build() would split them. The root does not grow:
+        // parts of new triangles outside of it are not indexed. Removed triangles (all the items with
+        // the given ids) are taken out of their leaves, which stay allocated even if empty, and inner
+        // nodes whose leaves would no longer split them collapse into a leaf. The cell budget is not
+        // enforced. Both return the leaves created or modified by the edit: the region to re-mesh is
+        // the union of their boxes. Items of removed triangles and nodes of collapsed subtrees are only
+        // released by the destructor. The CSR lists (leaf_item_offsets/indices) are compacted again,
+        // dropping removed items, at their next access
+        const std::vector<const TwseventreeNode*> & insert_triangles(const std::vector<vec3d> & verts,
+                                                                     const std::vector<uint>  & tris,
+                                                                     const std::vector<uint>  & ids);
+        const std::vector<const TwseventreeNode*> & remove_triangles(const std::vector<uint>  & ids);
+
+        // deformation with fixed connectivity (e.g. the frames of a morph): tris lists the vertices of
+        // all the items in their order (the tris of the build, then those of insert_triangles). Only
+        // the items whose vertices moved are reclassified: they leave the leaves they no longer overlap
+        // and enter the new ones, which split, while fathers of the leaves they left may collapse.
+        // Returns the leaves created or modified, as insert/remove do. Triangles only
+        const std::vector<const TwseventreeNode*> & refit(const std::vector<vec3d> & verts,
+                                                          const std::vector<uint>  & tris);
+
+        // QUERIES :::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // best first traversal with a PrioQueue: nodes and items are visited by increasing distance
+        // from p, so the search stops at the first item popped. Ids are those items were pushed with
+        vec3d closest_point(const vec3d & p) const;
+        void  closest_point(const vec3d & p, uint & id, vec3d & pos, double & dist) const;
+
+        // the k items closest to p (each once, even if it lives in several leaves), by increasing distance
+        void  k_nearest(const vec3d & p, const uint k, std::vector<uint> & ids, std::vector<vec3d> & pos, std::vector<double> & dist) const;
+
+        // one closest_point query per point, answered in parallel
+        void  closest_points(const std::vector<vec3d> & p, std::vector<uint> & ids, std::vector<vec3d> & pos, std::vector<double> & dist) const;
+
+        // first item hit by the ray p + t*dir, with t in [0,t_max] (a segment a-b is the ray a, b-a with
+        // t_max = 1). Children are visited in ray order, stepping through their 3x3x3 grid from plane to
+        // plane, and the search stops as soon as the next child starts beyond the closest hit. A zero
+        // dir (e.g. a degenerate segment) hits nothing
+        bool  intersects_ray(const vec3d & p, const vec3d & dir, double & t, uint & id, const double t_max = inf_double) const;
+
+        // packet of n <= 8 rays, traversed together: a node is visited once for all the rays that cross
+        // it, and the vertices of each leaf item are fetched once and tested against all of them. Rays
+        // should be coherent (similar origins and directions). Misses get id -1 and t = inf
+        void  intersects_ray_packet(const vec3d * p, const vec3d * dir, const uint n, double * t, int * ids, const double t_max = inf_double) const;
+
+        // batch of rays spread across threads. Coherent batches (e.g. camera tiles, with neighboring rays
+        // next to each other) go in packets of 8 consecutive rays; scattered rays, as in inside/outside
+        // or thickness probes, are faster one by one, as each of them crosses different leaves
+        void  intersects_rays(const std::vector<vec3d> & p, const std::vector<vec3d> & dir, std::vector<double> & t, std::vector<int> & ids,
+                              const double t_max = inf_double, const bool coherent = false) const;
+
+        // range queries with a caller owned context (see TwseventreeQueryContext): no heap allocation
+        // once the context is warm and no shared mutable state, hence safe to run from many threads.
+        // Results go in ctx.ids (each item once) and ctx.leaves, in no particular order
+        void  query_box   (const AABB & box, TwseventreeQueryContext & ctx) const;                 // items whose AABB overlaps box
+        void  query_sphere(const vec3d & c, const double r, TwseventreeQueryContext & ctx) const; // items closer than r to c
+        void  query_leaves(const AABB & box, TwseventreeQueryContext & ctx) const;                 // leaves overlapping box
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        // nodes with at least this many items distribute them to their children in parallel
+        void set_parallel_distribution_threshold(const uint n) { parallel_distribution_threshold = n; }
+
+        // if true, triangles are assigned only to the children they really intersect, rather than
+        // to all the children their AABB intersects (fewer items per leaf, hence fewer leaves)
+        void set_exact_triangle_box(const bool b) { exact_triangle_box = b; }
 
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
         template<class M, class V, class E, class P>
         void build_from_mesh_polys(const AbstractPolygonMesh<M,V,E,P> & m)
         {
-            assert(items.empty());
-            items.reserve(m.num_polys());
+            assert(num_items()==0);
+            if(triangle_soa) soa_tris.reserve(m.num_polys());
+            else             items.reserve(m.num_polys());
             for(uint pid=0; pid<m.num_polys(); ++pid)
             {
-                for(uint i=0; i<m.poly_tessellation(pid).size()/3; ++i)
+                const std::vector<uint> & tess = m.poly_tessellation(pid);
+                for(uint i=0; i<tess.size()/3; ++i)
                 {
-                    vec3d v0 = m.vert(m.poly_tessellation(pid).at(3*i+0));
-                    vec3d v1 = m.vert(m.poly_tessellation(pid).at(3*i+1));
-                    vec3d v2 = m.vert(m.poly_tessellation(pid).at(3*i+2));
-                    push_triangle(pid, {v0,v1,v2});
+                    push_triangle(pid, m.vert(tess.at(3*i+0)), m.vert(tess.at(3*i+1)), m.vert(tess.at(3*i+2)));
                 }
             }
             build();
@@ -119,19 +450,28 @@ class Twseventree
         void build_from_vectors(const std::vector<vec3d> & verts,
                                 const std::vector<uint>  & tris)
         {
-            assert(items.empty());
-            items.reserve(tris.size()/3);
+            assert(num_items()==0);
+            if(triangle_soa) soa_tris.reserve(tris.size()/3);
+            else             items.reserve(tris.size()/3);
             for(uint i=0; i<tris.size(); i+=3)
             {
-                push_triangle(i/3, { verts.at(tris.at(i  )),
-                                    verts.at(tris.at(i+1)),
-                                    verts.at(tris.at(i+2))});
+                push_triangle(i/3, verts.at(tris.at(i  )),
+                                   verts.at(tris.at(i+1)),
+                                   verts.at(tris.at(i+2)));
             }
             build();
         }
 
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
+        // bulk ingestion of a triangle soup from raw buffers (xyz: 3*nv coordinates, tris: 3*nt
+        // vertex ids). Switches to triangle SoA storage, fills it in parallel and allocates
+        // nothing per triangle. Triangle ids are their positions in tris
+        void build_from_buffers(const double * xyz,  const size_t nv,
+                                const uint   * tris, const size_t nt);
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
         template<class M, class V, class E, class P>
         void build_from_mesh_edges(const AbstractMesh<M,V,E,P> & m)
         {
@@ -147,11 +487,23 @@ class Twseventree
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
         uint max_items_per_leaf() const;
+        size_t num_implicit_leaves() const { return implicit_leaves; } // empty leaves not in leaves
+
+        // CSR item lists of the leaves, in the same order of leaves: the items of leaves[i]
+        // are leaf_item_indices()[leaf_item_offsets()[i] .. leaf_item_offsets()[i+1]]. Edits leave
+        // them stale, and the first access after an edit compacts them again
+        const std::vector<uint> & leaf_item_offsets() { if(csr_stale) compact_item_indices(); return leaf_offsets;   }
+        const std::vector<uint> & leaf_item_indices() { if(csr_stale) compact_item_indices(); return leaf_item_ids; }
+        void compact_item_indices(); // moves the item lists of all leaves in the CSR arrays (done by build)
+        void benchmark_child_classification(const uint rounds = 10) const; // prints timings of old vs new kernel
+        AABB items_bbox() const; // parallel reduction for the SoA storage
+        uint num_items() const { return triangle_soa ? soa_tris.size() : (uint)items.size(); }
+        AABB item_aabb(const uint it) const { return triangle_soa ? soa_tris.aabb(it) : items.at(it)->aabb; }
 
         // all items live here, and leaf nodes only store indices to items
         std::vector<SpatialDataStructureItem*>     items;
         TwseventreeNode                            *root = nullptr;
-        std::vector<const TwseventreeNode*>        leaves;
+        std::vector<const TwseventreeNode*>        leaves; // allocated leaves only (see for_each_leaf)
 
         //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 
@@ -161,6 +513,106 @@ class Twseventree
         uint items_per_leaf; // prescribed number of items per leaf (can't go deeper than max_depth anyways)
         uint tree_depth = 0; // actual depth of the tree
         bool print_debug_info = true;
+        uint parallel_distribution_threshold = 65536;
+        uint distribution_chunk_size         = 4096;
+        bool exact_triangle_box              = false;
+        bool triangle_soa                    = false;
+        bool root_brick                      = false;
+
+        AABB brick;                    // region covered by the grid when root_brick is true
+        uint brick_cubes[3] = {1,1,1}; // cubes of the brick along each axis
+        uint brick_levels   = 0;       // depth of the cubes of the brick is brick_levels+1
+        double brick_side   = 0;       // side of the cubes of the brick
+
+        vec3d  lattice_origin = vec3d(0,0,0);
+        double lattice_base   = 0;     // side of the base cells of the global lattice (0: not anchored)
+        uint   lattice_levels = 0;     // levels of the tree above the base cells
+
+        void anchor_root_to_lattice(); // places the root, and the brick of base cells covering the items
+
+        size_t cell_budget       = 0;
+        size_t predicted_cells   = 0;
+        uint   prediction_passes = 0;
+
+        void refine_with_budget(); // PrioQueue driven refinement of the children of the root
+
+        SizingField         sizing_field;
+        double              max_normal_deviation = 0;
+        std::vector<double> item_target_size;  // per item minimum of the sizing field
+        std::vector<vec3d>  item_normals;      // per triangle unit normal (zero for other items)
+        std::vector<double> item_triangle_size; // per triangle longest edge (zero for other items)
+
+        void init_refinement_criteria(const uint first_item = 0); // items from first_item on
+        void update_refinement_criteria(const std::vector<uint> & its); // only the given items (e.g. those moved by refit)
+        void item_refinement_criteria(const uint it);
+
+        std::unordered_map<const TwseventreeNode*,uint> leaf_slot; // position of each leaf in leaves (built by the first edit)
+        std::unordered_multimap<uint,uint>              id_items;  // items of each id (built by the first removal)
+        bool                                            id_items_ready = false;
+        std::vector<bool>                               removed_items; // items of removed triangles (sized by the first removal)
+        std::vector<const TwseventreeNode*>             edited_leaves;
+
+        typedef std::unordered_map<TwseventreeNode*,std::vector<uint>> ItemsOfLeaf;
+
+        uint  item_id(const uint it) const { return triangle_soa ? soa_tris.ids.at(it) : items.at(it)->id; }
+        vec3d item_closest_point(const uint it, const vec3d & p) const;
+        bool  item_ray_hit(const uint it, const vec3d & p, const vec3d & dir, double & t) const;
+
+        static constexpr uint ray_packet_size = 8;
+        struct RayPacket
+        {
+            double o[3][ray_packet_size];   // origins
+            double d[3][ray_packet_size];   // directions
+            double inv[3][ray_packet_size]; // inverse directions
+            double best[ray_packet_size];   // closest hit so far (t_max if none)
+            int    hit[ray_packet_size];    // storage index of the item hit (-1 if none)
+            uint   n;
+        };
+        static bool clip_ray(const AABB & box, const vec3d & p, const vec3d & dir, const vec3d & inv, double & t0, double & t1); // slabs
+        static uint32_t clip_ray_packet(const AABB & box, const RayPacket & rp, double *t0, double *t1); // clip_ray for all the lanes, mask of those that cross box
+        uint ray_children(const AABB & box, const vec3d & p, const vec3d & dir, const vec3d & inv, const double t0, const double t1,
+                          uint child[7], double t_in[7], double t_out[7]) const; // children crossed in [t0,t1], in ray order
+        void ray_visit   (const TwseventreeNode *node, const vec3d & p, const vec3d & dir, const vec3d & inv, const double t0, const double t1, double & best, int & hit) const;
+        void packet_visit(const TwseventreeNode *node, RayPacket & rp, const uint32_t active, const double *t0, const double *t1) const;
+        void add_leaf   (const TwseventreeNode *leaf);
+        void remove_leaf(const TwseventreeNode *leaf);
+        void begin_edit();
+        void find_item_leaves(const uint it, const bool allocate, std::vector<TwseventreeNode*> & out); // allocate: create empty children on the way
+        void add_items   (ItemsOfLeaf & added);   // then splits the leaves
+        void remove_items(ItemsOfLeaf & removed); // in place, no collapse
+        void collapse_fathers(const std::vector<const TwseventreeNode*> & nodes);
+        void split_edited_leaves(std::vector<std::pair<TwseventreeNode*,uint>> & todo); // (leaf, depth) pairs
+        void finish_edit(); // keeps in edited_leaves only the nodes that are still leaves, once each
+
+        uint   dense_levels = 0;
+        uint   dense_levels_built = 0;
+        size_t dense_occupied     = 0; // occupied cells of the finest dense level
+        double dense_time         = 0;
+
+        void place_root(); // pads the items box of the root to a cube (or to a brick)
+        void build_dense_levels(std::vector<std::pair<TwseventreeNode*,uint>> & seeds); // seeds: frontier nodes and their depth
+        uint node_depth(const TwseventreeNode *node) const; // root = 1
+
+        TwseventreeTriangles soa_tris; // item storage when triangle_soa is true
+
+        mutable std::atomic<size_t> exact_rejections; // (item,child) pairs discarded by the exact test
+
+        TwseventreeNodePool  pool;       // owns all the nodes of the tree
+        TwseventreeIndexPool index_pool; // item lists of inner nodes and not yet compacted leaves
+        std::vector<uint>    leaf_offsets;
+        std::vector<uint>    leaf_item_ids;
+        bool                 csr_stale = false; // leaf lists edited since the last compact_item_indices()
+        std::atomic<size_t>  vector_allocs_estimate; // allocations the same lists would need as growing std::vectors
+        std::atomic<size_t>  implicit_leaves;        // empty children, never allocated
+        std::atomic<size_t>  dropped_cells;          // empty children out of the root brick
+
+        uint32_t child_mask (const TwseventreeNode *node, const uint it) const; // bit i set = item it goes to child i
+        void     child_masks(const TwseventreeNode *node, const uint *its, const uint n, uint32_t *masks, const bool exact) const; // exact: refine with triangle/box tests
+        void     split_planes(const AABB & cell, double planes[3][4]) const;
+
+        // classifies the items of node and writes the 27 children lists in a single block of the
+        // index pool, which is returned. The list of child j is block[begin[j] .. begin[j+1]]
+        uint *   distribute_items(const TwseventreeNode *node, uint begin[28]);
 
         // SUPPORT STRUCTURES ::::::::::::::::::::::::::::::::::::::::::::::::::::
 
@@ -168,7 +620,7 @@ class Twseventree
         {
             double      dist  = inf_double;
             TwseventreeNode *node  = nullptr;
-            int         index = -1; // note: this is the item ID, NOT necessarily the index of vector items!!
+            int         index = -1; // index of the item in the tree storage (-1 for nodes), NOT its id
             vec3d       pos;        // closest point
         };
         struct Greater
@@ -0,0 +1,130 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+#include <work_stealing_pool.h>
+#include <cinolib/how_many_seconds.h>
+
+namespace cinolib
+{
+
+CINO_INLINE
+WorkStealingPool::WorkStealingPool(const uint num_threads)
+: pending(0)
+{
+    uint n = std::max(1u, num_threads);
+    for(uint i=0; i<n; ++i) queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    worker_stats.resize(n);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void WorkStealingPool::push(const uint worker, const Task & task)
+{
+    assert(worker<queues.size());
+    pending.fetch_add(1);
+    std::lock_guard<std::mutex> lock(queues.at(worker)->mutex);
+    queues.at(worker)->tasks.push_back(task);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+void WorkStealingPool::run()
+{
+    typedef std::chrono::high_resolution_clock Time;
+
+    auto worker_loop = [&](const uint worker)
+    {
+        Task task;
+        while(pending.load()>0)
+        {
+            bool stolen = false;
+            if(!pop(worker,task))
+            {
+                if(!steal(worker,task))
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                stolen = true;
+            }
+
+            Time::time_point t0 = Time::now();
+            task(worker);
+            Time::time_point t1 = Time::now();
+
+            WorkerStats & s = worker_stats.at(worker);
+            s.busy_time += how_many_seconds(t0,t1);
+            s.executed  += 1;
+            s.stolen    += stolen ? 1 : 0;
+
+            // tasks spawned by task(worker) are already accounted in pending,
+            // hence the counter cannot drop to zero while there is still work to do
+            pending.fetch_sub(1);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(uint i=1; i<num_threads(); ++i) threads.push_back(std::thread(worker_loop, i));
+    worker_loop(0); // the calling thread is worker 0
+    for(auto & t : threads) t.join();
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool WorkStealingPool::pop(const uint worker, Task & task)
+{
+    Queue & q = *queues.at(worker);
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(q.tasks.empty()) return false;
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+CINO_INLINE
+bool WorkStealingPool::steal(const uint worker, Task & task)
+{
+    for(uint i=1; i<num_threads(); ++i)
+    {
+        Queue & q = *queues.at((worker+i)%num_threads());
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if(q.tasks.empty()) continue;
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+}
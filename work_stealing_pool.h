@@ -0,0 +1,99 @@
+/********************************************************************************
+*  This file is part of CinoLib                                                 *
+*  Copyright(C) 2016: Marco Livesu                                              *
+*                                                                               *
+*  The MIT License                                                              *
+*                                                                               *
+*  Permission is hereby granted, free of charge, to any person obtaining a      *
+*  copy of this software and associated documentation files (the "Software"),   *
+*  to deal in the Software without restriction, including without limitation    *
+*  the rights to use, copy, modify, merge, publish, distribute, sublicense,     *
+*  and/or sell copies of the Software, and to permit persons to whom the        *
+*  Software is furnished to do so, subject to the following conditions:         *
+*                                                                               *
+*  The above copyright notice and this permission notice shall be included in   *
+*  all copies or substantial portions of the Software.                          *
+*                                                                               *
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR   *
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,     *
+*  FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE *
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER       *
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING      *
+*  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS *
+*  IN THE SOFTWARE.                                                             *
+*                                                                               *
+*  Author(s):                                                                   *
+*                                                                               *
+*     Daniele Ortu                                                              *
+*********************************************************************************/
+
+
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <cinolib/cino_inline.h>
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cinolib
+{
+
+// Minimal work stealing scheduler for recursive (divide and conquer) workloads.
+// Each worker owns a deque: it pushes and pops its own tasks at the back (depth first,
+// cache friendly), and when it runs dry it steals from the front of the other deques,
+// where the oldest (hence biggest) tasks are. Tasks can spawn other tasks, and run()
+// returns only when all of them have been executed.
+class WorkStealingPool
+{
+    public:
+
+        typedef std::function<void(const uint worker)> Task;
+
+        struct WorkerStats
+        {
+            size_t executed  = 0;   // number of tasks executed by the worker
+            size_t stolen    = 0;   // how many of them were stolen from other workers
+            double busy_time = 0.0; // seconds spent executing tasks
+        };
+
+        explicit WorkStealingPool(const uint num_threads = std::thread::hardware_concurrency());
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        void push(const uint worker, const Task & task); // worker = queue receiving the task
+        void run();
+
+        //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+        uint                             num_threads() const { return (uint)queues.size(); }
+        const std::vector<WorkerStats> & stats()       const { return worker_stats; }
+
+    private:
+
+        bool pop  (const uint worker, Task & task);
+        bool steal(const uint worker, Task & task);
+
+        struct Queue
+        {
+            std::deque<Task> tasks;
+            std::mutex       mutex;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<WorkerStats>            worker_stats;
+        std::atomic<size_t>                 pending; // pushed but not yet completed tasks
+};
+
+}
+
+#ifndef  CINO_STATIC_LIB
+#include "work_stealing_pool.cpp"
+#endif
+
+#endif // WORK_STEALING_POOL_H